@@ -0,0 +1,408 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+/*
+ * Allocator workloads going through the standard malloc API. The same
+ * binary runs on glibc, or on libosmem with libosmem_preload.so loaded,
+ * so both are measured the same way. The bookkeeping of the benchmark
+ * itself is mapped directly to stay out of the allocator being measured.
+ */
+
+// One operation out of SAMPLE_EVERY gets its latency measured
+#define SAMPLE_EVERY 8
+
+#define MAX_THREADS 64
+
+struct worker {
+	pthread_t thread;
+	int id;
+	uint64_t seed;
+
+	// Operations done and the latencies sampled on the way, in nanoseconds
+	uint64_t ops;
+	uint32_t *samples;
+	size_t nr_samples;
+	size_t max_samples;
+};
+
+struct workload {
+	const char *name;
+	void *(*run)(void *arg);
+	uint64_t ops_per_thread;
+	int threads;
+};
+
+static int nr_threads = 1;
+
+static void *bench_map(size_t size)
+{
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	return mem;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t next_random(struct worker *w)
+{
+	// xorshift64
+	w->seed ^= w->seed << 13;
+	w->seed ^= w->seed >> 7;
+	w->seed ^= w->seed << 17;
+
+	return w->seed;
+}
+
+static size_t random_size(struct worker *w, size_t min, size_t max)
+{
+	return min + next_random(w) % (max - min + 1);
+}
+
+static int should_sample(struct worker *w)
+{
+	return w->ops % SAMPLE_EVERY == 0 && w->nr_samples < w->max_samples;
+}
+
+static void record(struct worker *w, uint64_t start)
+{
+	w->samples[w->nr_samples++] = now_ns() - start;
+}
+
+// Wrappers that count the operation and sample its latency
+static void *timed_malloc(struct worker *w, size_t size)
+{
+	void *ptr;
+
+	if (should_sample(w)) {
+		uint64_t start = now_ns();
+
+		ptr = malloc(size);
+		record(w, start);
+	} else {
+		ptr = malloc(size);
+	}
+
+	w->ops++;
+
+	if (!ptr) {
+		fprintf(stderr, "malloc(%zu) failed\n", size);
+		exit(EXIT_FAILURE);
+	}
+
+	// Touch the block like a real user would
+	*(volatile char *)ptr = 1;
+
+	return ptr;
+}
+
+static void *timed_calloc(struct worker *w, size_t size)
+{
+	void *ptr;
+
+	if (should_sample(w)) {
+		uint64_t start = now_ns();
+
+		ptr = calloc(1, size);
+		record(w, start);
+	} else {
+		ptr = calloc(1, size);
+	}
+
+	w->ops++;
+
+	if (!ptr) {
+		fprintf(stderr, "calloc(%zu) failed\n", size);
+		exit(EXIT_FAILURE);
+	}
+
+	return ptr;
+}
+
+static void *timed_realloc(struct worker *w, void *old, size_t size)
+{
+	void *ptr;
+
+	if (should_sample(w)) {
+		uint64_t start = now_ns();
+
+		ptr = realloc(old, size);
+		record(w, start);
+	} else {
+		ptr = realloc(old, size);
+	}
+
+	w->ops++;
+
+	if (!ptr) {
+		fprintf(stderr, "realloc(%zu) failed\n", size);
+		exit(EXIT_FAILURE);
+	}
+
+	((volatile char *)ptr)[size - 1] = 1;
+
+	return ptr;
+}
+
+static void timed_free(struct worker *w, void *ptr)
+{
+	if (should_sample(w)) {
+		uint64_t start = now_ns();
+
+		free(ptr);
+		record(w, start);
+	} else {
+		free(ptr);
+	}
+
+	w->ops++;
+}
+
+static uint64_t ops_per_thread;
+
+// Random sizes, mostly small, allocated and freed in random order
+#define CHURN_SLOTS 4096
+
+static void *run_churn(void *arg)
+{
+	struct worker *w = arg;
+	void **slots = bench_map(CHURN_SLOTS * sizeof(void *));
+
+	while (w->ops < ops_per_thread) {
+		size_t i = next_random(w) % CHURN_SLOTS;
+
+		if (slots[i]) {
+			timed_free(w, slots[i]);
+			slots[i] = NULL;
+			continue;
+		}
+
+		unsigned int kind = next_random(w) % 100;
+		size_t size = kind < 70 ? random_size(w, 16, 256) :
+					  kind < 95 ? random_size(w, 257, 4096) : random_size(w, 4097, 65536);
+
+		slots[i] = timed_malloc(w, size);
+	}
+
+	for (size_t i = 0; i < CHURN_SLOTS; i++)
+		if (slots[i])
+			free(slots[i]);
+
+	return NULL;
+}
+
+// Fixed-size objects allocated and freed in short bursts
+#define PINGPONG_SIZE 64
+#define PINGPONG_BURST 16
+
+static void *run_pingpong(void *arg)
+{
+	struct worker *w = arg;
+	void *burst[PINGPONG_BURST];
+
+	while (w->ops < ops_per_thread) {
+		for (int i = 0; i < PINGPONG_BURST; i++)
+			burst[i] = timed_malloc(w, PINGPONG_SIZE);
+
+		for (int i = 0; i < PINGPONG_BURST; i++)
+			timed_free(w, burst[i]);
+	}
+
+	return NULL;
+}
+
+/*
+ * Larson: every thread replaces random blocks of its own set, and the sets
+ * are passed on to the next thread between rounds, so blocks are freed by
+ * other threads than the ones that allocated them.
+ */
+#define LARSON_SLOTS 1024
+#define LARSON_ROUNDS 16
+
+static void **larson_sets[MAX_THREADS];
+static pthread_barrier_t larson_barrier;
+
+static void *run_larson(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t round_ops = ops_per_thread / LARSON_ROUNDS;
+
+	larson_sets[w->id] = bench_map(LARSON_SLOTS * sizeof(void *));
+
+	for (size_t i = 0; i < LARSON_SLOTS; i++)
+		larson_sets[w->id][i] = timed_malloc(w, random_size(w, 16, 512));
+
+	for (int round = 0; round < LARSON_ROUNDS; round++) {
+		void **set = larson_sets[(w->id + round) % nr_threads];
+		uint64_t end = w->ops + round_ops;
+
+		while (w->ops < end) {
+			size_t i = next_random(w) % LARSON_SLOTS;
+
+			timed_free(w, set[i]);
+			set[i] = timed_malloc(w, random_size(w, 16, 512));
+		}
+
+		pthread_barrier_wait(&larson_barrier);
+	}
+
+	pthread_barrier_wait(&larson_barrier);
+
+	for (size_t i = 0; i < LARSON_SLOTS; i++)
+		free(larson_sets[w->id][i]);
+
+	return NULL;
+}
+
+// Vectors grown by half their size at a time, like a growable array
+#define REALLOC_MAX_SIZE (256 * 1024)
+
+static void *run_realloc(void *arg)
+{
+	struct worker *w = arg;
+
+	while (w->ops < ops_per_thread) {
+		size_t size = 16;
+		void *vector = timed_malloc(w, size);
+
+		while (size < REALLOC_MAX_SIZE) {
+			size += size / 2;
+			vector = timed_realloc(w, vector, size);
+		}
+
+		timed_free(w, vector);
+	}
+
+	return NULL;
+}
+
+// Large zeroed arrays, only a few of their pages are touched
+static void *run_calloc(void *arg)
+{
+	struct worker *w = arg;
+
+	while (w->ops < ops_per_thread) {
+		size_t size = random_size(w, 64 * 1024, 8 * 1024 * 1024);
+		char *array = timed_calloc(w, size);
+
+		for (size_t i = 0; i < size; i += 64 * 1024)
+			array[i] = 1;
+
+		timed_free(w, array);
+	}
+
+	return NULL;
+}
+
+static const struct workload workloads[] = {
+	{ "churn", run_churn, 4000000, 1 },
+	{ "pingpong", run_pingpong, 10000000, 1 },
+	{ "larson", run_larson, 2000000, 4 },
+	{ "realloc", run_realloc, 1000000, 1 },
+	{ "calloc", run_calloc, 20000, 1 },
+};
+
+static int compare_samples(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s <workload> [label] [threads]\nworkloads:", name);
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+		fprintf(stderr, " %s", workloads[i].name);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	const struct workload *workload = NULL;
+
+	if (argc < 2)
+		usage(argv[0]);
+
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+		if (!strcmp(argv[1], workloads[i].name))
+			workload = &workloads[i];
+
+	if (!workload)
+		usage(argv[0]);
+
+	const char *label = argc > 2 ? argv[2] : "-";
+
+	nr_threads = argc > 3 ? atoi(argv[3]) : workload->threads;
+	if (nr_threads < 1 || nr_threads > MAX_THREADS)
+		usage(argv[0]);
+
+	ops_per_thread = workload->ops_per_thread;
+	pthread_barrier_init(&larson_barrier, NULL, nr_threads);
+
+	struct worker *workers = bench_map(nr_threads * sizeof(struct worker));
+	size_t max_samples = ops_per_thread / SAMPLE_EVERY + LARSON_SLOTS;
+
+	for (int i = 0; i < nr_threads; i++) {
+		workers[i].id = i;
+		workers[i].seed = 88172645463325252ULL + i;
+		workers[i].max_samples = max_samples;
+		workers[i].samples = bench_map(max_samples * sizeof(uint32_t));
+	}
+
+	uint64_t start = now_ns();
+
+	for (int i = 0; i < nr_threads; i++)
+		pthread_create(&workers[i].thread, NULL, workload->run, &workers[i]);
+
+	for (int i = 0; i < nr_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	uint64_t elapsed = now_ns() - start;
+
+	// Put the samples of every thread together
+	uint64_t ops = 0;
+	size_t nr_samples = 0;
+	uint32_t *samples = bench_map(nr_threads * max_samples * sizeof(uint32_t));
+
+	for (int i = 0; i < nr_threads; i++) {
+		ops += workers[i].ops;
+		memcpy(samples + nr_samples, workers[i].samples, workers[i].nr_samples * sizeof(uint32_t));
+		nr_samples += workers[i].nr_samples;
+	}
+
+	qsort(samples, nr_samples, sizeof(uint32_t), compare_samples);
+
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("%-8s %-10s %2d threads %12.0f ops/s  p50 %6u ns  p99 %7u ns  peak RSS %8ld KB\n",
+		   label, workload->name, nr_threads, ops * 1e9 / elapsed,
+		   nr_samples ? samples[nr_samples / 2] : 0, nr_samples ? samples[nr_samples * 99 / 100] : 0,
+		   usage.ru_maxrss);
+
+	return 0;
+}
@@ -0,0 +1,442 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "osmem.h"
+#include "trace.h"
+
+/*
+ * Replays a trace recorded with OSMEM_TRACE against libosmem.so, in the
+ * order of the records' times and from a single thread. The memory system
+ * calls of the allocator are counted by interposing them, and the memory
+ * it got from the system is followed to report its peak.
+ */
+
+struct syscall_stats {
+	unsigned long brk;
+	unsigned long mmap;
+	unsigned long munmap;
+	unsigned long mremap;
+	unsigned long madvise;
+
+	// Bytes the allocator got with sbrk() and mmap(), and the most it had at once
+	long heap;
+	long peak_heap;
+};
+
+static struct syscall_stats stats;
+
+// Records with no block to match, like the frees of blocks allocated before the trace started
+static unsigned long unmatched;
+
+static void *real_symbol(const char *name)
+{
+	void *symbol = dlsym(RTLD_NEXT, name);
+
+	if (!symbol) {
+		fprintf(stderr, "cannot find %s\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	return symbol;
+}
+
+static void heap_grown(long bytes)
+{
+	stats.heap += bytes;
+	if (stats.heap > stats.peak_heap)
+		stats.peak_heap = stats.heap;
+}
+
+void *sbrk(intptr_t increment)
+{
+	static void *(*real_sbrk)(intptr_t);
+
+	if (!real_sbrk)
+		real_sbrk = real_symbol("sbrk");
+
+	void *ret = real_sbrk(increment);
+
+	// sbrk(0) only reads the cached break
+	if (increment && ret != (void *)-1) {
+		stats.brk++;
+		heap_grown(increment);
+	}
+
+	return ret;
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	static void *(*real_mmap)(void *, size_t, int, int, int, off_t);
+
+	if (!real_mmap)
+		real_mmap = real_symbol("mmap");
+
+	void *ret = real_mmap(addr, length, prot, flags, fd, offset);
+
+	stats.mmap++;
+	if (ret != MAP_FAILED)
+		heap_grown(length);
+
+	return ret;
+}
+
+int munmap(void *addr, size_t length)
+{
+	static int (*real_munmap)(void *, size_t);
+
+	if (!real_munmap)
+		real_munmap = real_symbol("munmap");
+
+	int ret = real_munmap(addr, length);
+
+	stats.munmap++;
+	if (!ret)
+		stats.heap -= length;
+
+	return ret;
+}
+
+void *mremap(void *old_address, size_t old_size, size_t new_size, int flags, ...)
+{
+	static void *(*real_mremap)(void *, size_t, size_t, int, ...);
+	void *new_address = NULL;
+	va_list args;
+
+	if (!real_mremap)
+		real_mremap = real_symbol("mremap");
+
+	if (flags & MREMAP_FIXED) {
+		va_start(args, flags);
+		new_address = va_arg(args, void *);
+		va_end(args);
+	}
+
+	void *ret = real_mremap(old_address, old_size, new_size, flags, new_address);
+
+	stats.mremap++;
+	if (ret != MAP_FAILED)
+		heap_grown((long)new_size - (long)old_size);
+
+	return ret;
+}
+
+int madvise(void *addr, size_t length, int advice)
+{
+	static int (*real_madvise)(void *, size_t, int);
+
+	if (!real_madvise)
+		real_madvise = real_symbol("madvise");
+
+	stats.madvise++;
+
+	return real_madvise(addr, length, advice);
+}
+
+static void *map_or_die(size_t size)
+{
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	return mem;
+}
+
+static struct trace_record *load_trace(const char *path, size_t *count)
+{
+	struct trace_header header;
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if (fd == -1 || fstat(fd, &st) == -1 || read(fd, &header, sizeof(header)) != sizeof(header)) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) || header.version != TRACE_VERSION ||
+		header.record_size != sizeof(struct trace_record)) {
+		fprintf(stderr, "%s: not a trace of this version\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	*count = (st.st_size - sizeof(header)) / sizeof(struct trace_record);
+
+	struct trace_record *records = map_or_die(*count * sizeof(struct trace_record) + 1);
+	size_t len = *count * sizeof(struct trace_record);
+	char *data = (char *)records;
+
+	while (len) {
+		ssize_t ret = read(fd, data, len);
+
+		if (ret <= 0) {
+			perror(path);
+			exit(EXIT_FAILURE);
+		}
+
+		data += ret;
+		len -= ret;
+	}
+
+	close(fd);
+
+	return records;
+}
+
+// Where a record was in the file, qsort() moves the records themselves around
+struct sort_key {
+	uint64_t time;
+	size_t index;
+};
+
+static int compare_keys(const void *a, const void *b)
+{
+	const struct sort_key *x = a;
+	const struct sort_key *y = b;
+
+	if (x->time != y->time)
+		return (x->time > y->time) - (x->time < y->time);
+
+	// The records of a thread are in order in the file, and the sort is not stable
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+static struct trace_record *sort_records(struct trace_record *records, size_t count)
+{
+	struct sort_key *keys = map_or_die(count * sizeof(struct sort_key) + 1);
+	struct trace_record *sorted = map_or_die(count * sizeof(struct trace_record) + 1);
+
+	for (size_t i = 0; i < count; i++) {
+		keys[i].time = records[i].time;
+		keys[i].index = i;
+	}
+
+	qsort(keys, count, sizeof(struct sort_key), compare_keys);
+
+	for (size_t i = 0; i < count; i++)
+		sorted[i] = records[keys[i].index];
+
+	munmap(keys, count * sizeof(struct sort_key) + 1);
+	munmap(records, count * sizeof(struct trace_record) + 1);
+
+	return sorted;
+}
+
+/*
+ * Addresses get reused, so every block gets an id of its own, and the
+ * records refer to ids instead. Open addressing from the address to the id
+ * of the block that is live at it, 0 once it is freed.
+ */
+struct id_table {
+	uint64_t *addrs;
+	uint64_t *ids;
+	size_t mask;
+};
+
+static uint64_t *lookup_id(struct id_table *table, uint64_t addr)
+{
+	size_t i = (addr >> 4) * 0x9e3779b97f4a7c15ULL & table->mask;
+
+	while (table->addrs[i] && table->addrs[i] != addr)
+		i = (i + 1) & table->mask;
+
+	table->addrs[i] = addr;
+
+	return &table->ids[i];
+}
+
+static uint64_t take_id(struct id_table *table, uint64_t addr)
+{
+	uint64_t *id = lookup_id(table, addr);
+	uint64_t ret = *id;
+
+	if (!ret)
+		unmatched++;
+	*id = 0;
+
+	return ret;
+}
+
+static void give_id(struct id_table *table, uint64_t addr, uint64_t id)
+{
+	uint64_t *slot = lookup_id(table, addr);
+
+	// The block that was there was freed by a record that came too late
+	if (*slot)
+		unmatched++;
+	*slot = id;
+}
+
+// Turn the pointers of the records into ids, starting from 1, and return the next free one
+static uint64_t assign_ids(struct trace_record *records, size_t count)
+{
+	struct id_table table;
+	size_t size = 1;
+	uint64_t next_id = 1;
+
+	while (size < 2 * count)
+		size <<= 1;
+
+	table.addrs = map_or_die(size * sizeof(uint64_t));
+	table.ids = map_or_die(size * sizeof(uint64_t));
+	table.mask = size - 1;
+
+	for (size_t i = 0; i < count; i++) {
+		struct trace_record *record = &records[i];
+
+		switch (record->op) {
+		case TRACE_MALLOC:
+		case TRACE_CALLOC:
+		case TRACE_MEMALIGN:
+			if (record->ptr) {
+				give_id(&table, record->ptr, next_id);
+				record->ptr = next_id++;
+			}
+			break;
+
+		case TRACE_REALLOC: {
+			// An unknown block is replayed as a fresh allocation
+			uint64_t old_id = record->arg ? take_id(&table, record->arg) : 0;
+
+			// A failed realloc leaves the block where it was, there is nothing to replay
+			if (record->size && !record->ptr) {
+				if (old_id)
+					give_id(&table, record->arg, old_id);
+				record->op = 0;
+				break;
+			}
+
+			record->arg = old_id;
+			if (record->ptr) {
+				give_id(&table, record->ptr, next_id);
+				record->ptr = next_id++;
+			}
+			break;
+		}
+
+		case TRACE_FREE:
+			record->ptr = take_id(&table, record->ptr);
+			break;
+
+		default:
+			unmatched++;
+			record->op = 0;
+			break;
+		}
+	}
+
+	munmap(table.addrs, size * sizeof(uint64_t));
+	munmap(table.ids, size * sizeof(uint64_t));
+
+	return next_id;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	size_t count;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <trace>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	struct trace_record *records = load_trace(argv[1], &count);
+
+	records = sort_records(records, count);
+
+	uint64_t nr_ids = assign_ids(records, count);
+	void **blocks = map_or_die(nr_ids * sizeof(void *));
+	uint64_t *sizes = map_or_die(nr_ids * sizeof(uint64_t));
+	uint64_t live = 0, peak_live = 0;
+
+	// Only what the allocator does from now on is counted
+	memset(&stats, 0, sizeof(stats));
+
+	uint64_t start = now_ns();
+
+	for (size_t i = 0; i < count; i++) {
+		struct trace_record *record = &records[i];
+		void *ptr = NULL;
+
+		switch (record->op) {
+		case TRACE_MALLOC:
+			ptr = os_malloc(record->size);
+			break;
+
+		case TRACE_CALLOC:
+			ptr = os_calloc(1, record->size);
+			break;
+
+		case TRACE_MEMALIGN:
+			ptr = os_memalign(record->arg, record->size);
+			break;
+
+		case TRACE_REALLOC:
+			live -= sizes[record->arg];
+			ptr = os_realloc(record->arg ? blocks[record->arg] : NULL, record->size);
+			break;
+
+		case TRACE_FREE:
+			if (record->ptr) {
+				os_free(blocks[record->ptr]);
+				live -= sizes[record->ptr];
+			}
+			continue;
+
+		default:
+			continue;
+		}
+
+		if (!record->ptr)
+			continue;
+
+		// Write to the block like the program did
+		if (ptr)
+			*(volatile char *)ptr = 1;
+
+		blocks[record->ptr] = ptr;
+		sizes[record->ptr] = record->size;
+		live += record->size;
+		if (live > peak_live)
+			peak_live = live;
+	}
+
+	uint64_t elapsed = now_ns() - start;
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("records     %lu, %lu without a matching block\n", (unsigned long)count, unmatched);
+	printf("time        %lu us, %lu ns per call\n", (unsigned long)(elapsed / 1000),
+		   (unsigned long)(count ? elapsed / count : 0));
+	printf("syscalls    brk %lu, mmap %lu, munmap %lu, mremap %lu, madvise %lu\n",
+		   stats.brk, stats.mmap, stats.munmap, stats.mremap, stats.madvise);
+	printf("peak heap   %ld KB, for %lu KB of live blocks\n", stats.peak_heap / 1024, (unsigned long)(peak_live / 1024));
+	printf("peak RSS    %ld KB\n", usage.ru_maxrss);
+
+	return 0;
+}
@@ -1,81 +1,472 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#define _GNU_SOURCE
+#include <sys/mman.h>
+
 #include "alloc_helpers.h"
+#include "map_cache.h"
 
-extern struct block_meta *head;
-extern struct block_meta *tail;
+extern struct block_meta *mapped_list;
 
-extern void *heap_end;
+extern struct arena main_arena;
 
 extern int first_brk_alloc;
 
 extern size_t blk_meta_size;
 
+extern pthread_mutex_t heap_lock;
+
+extern int percpu_arenas;
+
+extern int huge_pages;
+
+extern size_t huge_page_bytes;
+
+void lock_heap(void)
+{
+	pthread_mutex_lock(&heap_lock);
+}
+
+void unlock_heap(void)
+{
+	pthread_mutex_unlock(&heap_lock);
+}
+
 void set_meta(struct block_meta *block, size_t size, int status)
 {
 	block->size = size;
 	block->status = status;
 	block->next = NULL;
 	block->prev = NULL;
+	block->flags = 0;
+}
+
+static uintptr_t page_align_up(uintptr_t addr)
+{
+	size_t page_size = getpagesize();
+
+	return (addr + page_size - 1) & ~(page_size - 1);
+}
+
+static uintptr_t page_align_down(uintptr_t addr)
+{
+	return addr & ~((uintptr_t)getpagesize() - 1);
+}
+
+// Map a block on whole huge pages, from the hugetlb pool if there is one, else with THP
+static struct block_meta *mmap_huge(size_t blk_size)
+{
+	size_t length = HUGE_ALIGN(blk_size + blk_meta_size);
+	char *mem = (char *) -1;
+	int flags = BLOCK_HUGE | BLOCK_PAGE_ROUNDED;
+
+	if (__atomic_load_n(&huge_pages, __ATOMIC_RELAXED) == OSMEM_HUGE_PAGES_HUGETLB) {
+		mem = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mem != (char *) -1)
+			flags |= BLOCK_HUGETLB;
+	}
+
+	// No pool was configured or it ran out, align a normal mapping for THP instead
+	if (mem == (char *) -1) {
+		char *raw = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (raw == (char *) -1)
+			return NULL;
+
+		mem = (char *)HUGE_ALIGN((uintptr_t)raw);
+
+		// Give back the unaligned edges of the mapping
+		if (mem != raw)
+			DIE(munmap(raw, mem - raw) == -1, "Error at munmap in alloc\n");
+		DIE(munmap(mem + length, HUGE_PAGE_SIZE - (mem - raw)) == -1, "Error at munmap in alloc\n");
+
+		if (madvise(mem, length, MADV_HUGEPAGE) == -1) {
+			set_meta((struct block_meta *)mem, length - blk_meta_size, STATUS_MAPPED);
+			return (struct block_meta *)mem;
+		}
+	}
+
+	struct block_meta *block = (struct block_meta *)mem;
+
+	// The block owns the whole mapping, so freeing it unmaps every huge page
+	set_meta(block, length - blk_meta_size, STATUS_MAPPED);
+	block->flags = flags;
+	__atomic_add_fetch(&huge_page_bytes, get_mapping_size(block), __ATOMIC_RELAXED);
+
+	return block;
 }
 
-void *mmap_alloc(size_t blk_size)
+void *mmap_alloc(size_t blk_size, int zero)
 {
+	// Reuse a region freed shortly before, its pages are already faulted in
+	struct block_meta *new_block = map_cache_get(blk_size);
+
+	if (new_block) {
+		// Unlike a fresh mapping, it still holds the data of its previous user
+		if (zero)
+			memset(get_addr_from_blk(new_block, blk_meta_size), 0, blk_size);
+		goto out;
+	}
+
+	if (blk_size + blk_meta_size >= HUGE_PAGE_SIZE && __atomic_load_n(&huge_pages, __ATOMIC_RELAXED)) {
+		new_block = mmap_huge(blk_size);
+		if (new_block)
+			goto out;
+	}
+
 	void *mem = mmap(NULL, blk_size + blk_meta_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-	DIE(mem == ((void *) -1), "Error at mmap in alloc\n");
+	// Out of memory is reported to the caller, like malloc() does
+	if (mem == ((void *) -1))
+		return NULL;
 
-	struct block_meta *new_block = (struct block_meta *)mem;
+	new_block = (struct block_meta *)mem;
 
 	set_meta(new_block, blk_size, STATUS_MAPPED);
 
-	add_in_list(&head, &tail, new_block, STATUS_MAPPED);
+out:
+	lock_heap();
+	add_mapped_blk(&mapped_list, new_block);
+	unlock_heap();
 
 	return get_addr_from_blk(new_block, blk_meta_size);
 }
 
-void *first_heap_alloc(size_t threshold)
+void *mmap_align(size_t blk_size, size_t alignment)
 {
-	// Mark the first heap allocation is being done
-	first_brk_alloc = 1;
+	// Enough room to move the payload up to the next aligned address
+	size_t length = page_align_up(blk_size + blk_meta_size + alignment);
+	char *mem = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
+	if (mem == ((void *) -1))
+		return NULL;
+
+	uintptr_t payload = ((uintptr_t)mem + blk_meta_size + alignment - 1) & ~(alignment - 1);
+	struct block_meta *new_block = get_block_from_addr((void *)payload, blk_meta_size);
+	char *start = (char *)page_align_down((uintptr_t)new_block);
+	char *end = (char *)page_align_up(payload + blk_size);
+
+	// Give back the pages before and after the block
+	if (start != mem)
+		DIE(munmap(mem, start - mem) == -1, "Error at munmap in align\n");
+	if (end != mem + length)
+		DIE(munmap(end, mem + length - end) == -1, "Error at munmap in align\n");
+
+	set_meta(new_block, blk_size, STATUS_MAPPED);
+	new_block->flags = BLOCK_PAGE_ROUNDED;
+
+	lock_heap();
+	add_mapped_blk(&mapped_list, new_block);
+	unlock_heap();
+
+	return (void *)payload;
+}
+
+size_t get_mapping_size(struct block_meta *block)
+{
+	uintptr_t end = (uintptr_t)get_addr_from_blk(block, blk_meta_size) + block->size;
+
+	// A hugetlb mapping starts at the block and ends on a huge page boundary
+	if (block->flags & BLOCK_HUGETLB)
+		return HUGE_ALIGN(end) - (uintptr_t)block;
+
+	// An aligned block may start inside the first page of its mapping
+	if (block->flags & BLOCK_PAGE_ROUNDED)
+		return page_align_up(end) - page_align_down((uintptr_t)block);
+
+	// A plain mapping starts at the block and is as long as it was asked to be
+	return end - (uintptr_t)block;
+}
+
+int unmap_blk(struct block_meta *block)
+{
+	if (block->flags & BLOCK_HUGE)
+		__atomic_sub_fetch(&huge_page_bytes, get_mapping_size(block), __ATOMIC_RELAXED);
+
+	return munmap((void *)page_align_down((uintptr_t)block), get_mapping_size(block));
+}
+
+struct block_meta *mremap_blk(struct block_meta *block, size_t blk_size)
+{
+	lock_heap();
+	remove_mapped_blk(&mapped_list, block);
+	unlock_heap();
+
+	size_t offset = (uintptr_t)block - page_align_down((uintptr_t)block);
+	size_t old_length = get_mapping_size(block);
+	size_t length = offset + blk_size + blk_meta_size;
+
+	// The kernel refuses to resize a hugetlb mapping by less than a huge page
+	if (block->flags & BLOCK_HUGETLB)
+		length = HUGE_ALIGN(length);
+
+	// The kernel moves the page table entries, the payload is never copied
+	void *mem = mremap((char *)block - offset, old_length, length, MREMAP_MAYMOVE);
+
+	// The old mapping is left untouched on failure
+	if (mem != ((void *) -1)) {
+		block = (struct block_meta *)((char *)mem + offset);
+
+		// A hugetlb block owns the rest of its last huge page
+		if (block->flags & BLOCK_HUGETLB)
+			blk_size = length - offset - blk_meta_size;
+		block->size = blk_size;
+
+		if (block->flags & BLOCK_HUGE)
+			__atomic_add_fetch(&huge_page_bytes, get_mapping_size(block) - old_length, __ATOMIC_RELAXED);
+	}
+
+	lock_heap();
+	add_mapped_blk(&mapped_list, block);
+	unlock_heap();
+
+	return mem == ((void *) -1) ? NULL : block;
+}
+
+void *first_heap_alloc(size_t threshold)
+{
 	// Do the prealloc
-	void *ret_addr = sbrk(threshold);
+	void *ret_addr = arena_sbrk(&main_arena, threshold);
 
-	// Check if sbrk failed
-	DIE(ret_addr == ((void *) -1), "Error at sbrk in heap alloc\n");
+	// A later, smaller allocation tries again
+	if (ret_addr == ((void *) -1))
+		return NULL;
 
-	heap_end = ret_addr;
+	// Mark the first heap allocation is being done
+	first_brk_alloc = 1;
 
 	struct block_meta *new_block = (struct block_meta *)ret_addr;
 
 	set_meta(new_block, threshold - blk_meta_size, STATUS_ALLOC);
+	ARENA_STAT_ADD(main_arena.nr_blocks, 1);
 
-	add_in_list(&head, &tail, new_block, STATUS_ALLOC);
+	main_arena.last_brk = new_block;
 
 	// Return the address of the allocated block
 	return get_addr_from_blk(new_block, blk_meta_size);
 }
 
-struct block_meta *new_heap(size_t blk_size)
+struct block_meta *new_heap(struct arena *arena, size_t blk_size)
 {
 	// Alloc the size that we need on the heap
-	void *ret_addr = sbrk(blk_size + blk_meta_size);
-
-	// Check if sbrk failed
-	DIE(ret_addr == ((void *) -1), "Error at sbrk in alloc new heap\n");
+	void *ret_addr = arena_sbrk(arena, blk_size + blk_meta_size);
 
-	heap_end = (char *)heap_end + blk_size + blk_meta_size;
+	// A per-CPU heap ran out of room, or the system out of memory
+	if (ret_addr == ((void *) -1))
+		return NULL;
 
 	struct block_meta *new_block = (struct block_meta *)ret_addr;
 
 	set_meta(new_block, blk_size, STATUS_ALLOC);
+	ARENA_STAT_ADD(arena->nr_blocks, 1);
 
-	add_in_list(&head, &tail, new_block, STATUS_ALLOC);
+	// Let the new block know if the previous last block is free
+	if (arena->last_brk)
+		update_boundary_tag(arena, arena->last_brk);
+	arena->last_brk = new_block;
 
 	return new_block;
 }
 
+void mark_dirty(struct arena *arena, struct block_meta *block)
+{
+	// The header of a remainder split off later lands right after the block
+	char *end = (char *)get_addr_from_blk(block, blk_meta_size) + block->size + blk_meta_size;
+
+	if (end > arena->zero_start)
+		arena->zero_start = end;
+}
+
+size_t purge_blk(struct block_meta *block)
+{
+	uintptr_t start = page_align_up((uintptr_t)get_addr_from_blk(block, blk_meta_size));
+	uintptr_t end = page_align_down((uintptr_t)get_addr_from_blk(block, blk_meta_size) + block->size);
+
+	if (block->flags & BLOCK_PURGED || start >= end)
+		return 0;
+
+	// The pages read as zero until they are written again
+	if (madvise((void *)start, end - start, MADV_DONTNEED) == -1)
+		return 0;
+
+	block->flags |= BLOCK_PURGED;
+	return end - start;
+}
+
+size_t get_purged_dirty_size(struct block_meta *block, size_t size)
+{
+	uintptr_t payload = (uintptr_t)get_addr_from_blk(block, blk_meta_size);
+
+	// Only the part before the first whole page may hold old data
+	if (!(block->flags & BLOCK_PURGED) || payload + size > page_align_down(payload + block->size))
+		return size;
+
+	size_t dirty = page_align_up(payload) - payload;
+
+	return dirty < size ? dirty : size;
+}
+
+struct block_meta *align_brk_blk(struct arena *arena, struct block_meta *block, size_t alignment, size_t size)
+{
+	uintptr_t payload = (uintptr_t)get_addr_from_blk(block, blk_meta_size);
+
+	if (payload & (alignment - 1)) {
+		// The slack before the aligned payload must hold a free block of its own
+		uintptr_t aligned = (payload + blk_meta_size + ALIGNMENT + alignment - 1) & ~(alignment - 1);
+		struct block_meta *aligned_block = get_block_from_addr((void *)aligned, blk_meta_size);
+
+		set_meta(aligned_block, block->size - (aligned - payload), STATUS_ALLOC);
+		aligned_block->owner = block->owner;
+		ARENA_STAT_ADD(arena->nr_blocks, 1);
+		block->size = (uintptr_t)aligned_block - payload;
+
+		if (block == arena->last_brk)
+			arena->last_brk = aligned_block;
+
+		// Give the slack back, merging it with a free block before it
+		free_brk_blk(arena, block, blk_meta_size);
+		block = aligned_block;
+	}
+
+	return split_blk(arena, block, size, blk_meta_size);
+}
+
+size_t trim_arena(struct arena *arena, size_t pad)
+{
+	struct block_meta *last = arena->last_brk;
+
+	if (!last || last->status != STATUS_FREE || !arena_can_shrink(arena))
+		return 0;
+
+	// Keep the last block, with at least 'pad' bytes, and give back whole pages after it
+	size_t keep = pad > ALIGNMENT ? ALIGN(pad) : ALIGNMENT;
+	size_t page_size = getpagesize();
+	uintptr_t new_end = (uintptr_t)get_addr_from_blk(last, blk_meta_size) + keep;
+
+	new_end = (new_end + page_size - 1) & ~(page_size - 1);
+	if (last->size <= keep || new_end >= (uintptr_t)arena->heap_end)
+		return 0;
+
+	size_t release = (uintptr_t)arena->heap_end - new_end;
+
+	remove_from_bin(arena, last);
+	last->size -= release;
+	arena_shrink(arena, release);
+	add_in_bin(arena, last);
+
+	// The pages given back come zero-filled if the heap grows again
+	if (arena->zero_start > (char *)arena->heap_end)
+		arena->zero_start = arena->heap_end;
+
+	return release;
+}
+
+struct block_meta *alloc_brk_blk(struct arena *arena, size_t blk_size, size_t *dirty)
+{
+	struct block_meta *new_block;
+	size_t purged_dirty = blk_size;
+
+	// The first allocation gets the whole preallocated chunk, a raised mmap threshold may ask for more
+	if (arena == &main_arena && first_brk_alloc == 0) {
+		size_t prealloc = blk_size + blk_meta_size > MMAP_THRESHOLD ? blk_size + blk_meta_size : MMAP_THRESHOLD;
+		void *first = first_heap_alloc(prealloc);
+
+		if (!first)
+			return NULL;
+
+		new_block = get_block_from_addr(first, blk_meta_size);
+		new_block->owner = arena->index;
+		goto out;
+	}
+
+	// Take back the blocks other threads freed in the meantime
+	drain_remote_frees(arena);
+
+	// Search for a suitable free block
+	new_block = find_block_with_size(arena, blk_size, blk_meta_size, &purged_dirty);
+
+	// Allocate a new block if no suitable free block is found
+	if (!new_block)
+		new_block = new_heap(arena, blk_size);
+
+	if (!new_block)
+		return NULL;
+
+	new_block->owner = arena->index;
+	new_block->flags = 0;
+
+out:
+	// Only the part below the zero mark may hold old data
+	if (dirty) {
+		char *start = get_addr_from_blk(new_block, blk_meta_size);
+		char *end = start + new_block->size;
+
+		*dirty = start >= arena->zero_start ? 0 : (size_t)((end < arena->zero_start ? end : arena->zero_start) - start);
+		if (purged_dirty < *dirty)
+			*dirty = purged_dirty;
+	}
+
+	mark_dirty(arena, new_block);
+
+	return new_block;
+}
+
+size_t alloc_brk_batch(struct arena *arena, size_t blk_size, size_t count, void **ptrs)
+{
+	// A single region holds all the blocks, with their headers in between
+	size_t stride = blk_size + blk_meta_size;
+	size_t region_size = count * stride - blk_meta_size;
+	struct block_meta *region = alloc_brk_blk(arena, region_size, NULL);
+
+	if (!region)
+		return 0;
+
+	// The preallocated chunk may be bigger than the region
+	split_blk(arena, region, region_size, blk_meta_size);
+
+	// What was too small to split off stays with the last block
+	size_t leftover = region->size - region_size;
+	int is_last = region == arena->last_brk;
+	struct block_meta *block = region;
+
+	// The first block keeps the boundary tag of the region
+	region->size = blk_size;
+	ptrs[0] = get_addr_from_blk(region, blk_meta_size);
+
+	for (size_t i = 1; i < count; i++) {
+		block = (struct block_meta *)((char *)region + i * stride);
+		set_meta(block, blk_size, STATUS_ALLOC);
+		block->owner = arena->index;
+		ptrs[i] = get_addr_from_blk(block, blk_meta_size);
+	}
+
+	block->size += leftover;
+	ARENA_STAT_ADD(arena->nr_blocks, count - 1);
+
+	if (is_last)
+		arena->last_brk = block;
+
+	return count;
+}
+
+void release_brk_blk(struct block_meta *block)
+{
+	struct arena *arena = get_blk_arena(block);
+	int foreign = arena != &main_arena && __atomic_load_n(&percpu_arenas, __ATOMIC_RELAXED) &&
+				  arena != get_current_arena();
+
+	// Never wait for the arena of another CPU or for a busy one, let its owner free the block
+	if (foreign || trylock_arena(arena)) {
+		push_remote_free(arena, block);
+		return;
+	}
+
+	// An arena that only frees would otherwise keep the blocks of other threads forever
+	drain_remote_frees(arena);
+	free_brk_blk(arena, block, blk_meta_size);
+	unlock_arena(arena);
+}
+
 void *get_addr_from_blk(struct block_meta *block, size_t meta_size)
 {
 	// The memory block starts right after the metadata
@@ -92,131 +483,89 @@ struct block_meta *get_block_from_addr(void *ret_addr, size_t loc_blk_meta_size)
 	return ret;
 }
 
-struct block_meta *expand_realloc(struct block_meta *head, struct block_meta *init,
-								  size_t req_size, size_t loc_blk_meta_size)
+struct block_meta *expand_realloc(struct arena *arena, struct block_meta *init, size_t req_size,
+								  size_t loc_blk_meta_size)
 {
-	if (!head) {
-		// List is empty, nothing to do
-		return NULL;
-	}
-
-	struct block_meta *current = head;
+	struct block_meta *next = get_next_brk_blk(arena, init);
+	int was_last = init == arena->last_brk;
 
-	// Traverse the list starting from the 'init' block
-	while (current != NULL) {
-		// Check if the current block is the one we want to expand
-		if (current == init) {
-			// Check if the next block is free and can be merged
-			while (current->next && current->next->status == STATUS_FREE) {
-				current->size += current->next->size + loc_blk_meta_size;
+	// Coalesce the following free blocks one at a time
+	while (next && next->status == STATUS_FREE) {
+		remove_from_bin(arena, next);
+		init->size += next->size + loc_blk_meta_size;
+		ARENA_STAT_ADD(arena->nr_blocks, -1);
 
-				struct block_meta *next = current->next;
+		if (next == arena->last_brk)
+			arena->last_brk = init;
 
-				current->next = next->next;
-				if (next->next && current != head)
-					next->next->prev = current;
+		update_boundary_tag(arena, init);
 
-				// Check if the block is now big enough
-				if (current->size >= req_size)
-					return split_blk(current, req_size, loc_blk_meta_size);
-			}
-
-			break;
+		// Check if the block is now big enough
+		if (init->size >= req_size) {
+			split_blk(arena, init, req_size, loc_blk_meta_size);
+			mark_dirty(arena, init);
+			return init;
 		}
 
-		// Move to the next block in the list
-		current = current->next;
+		next = get_next_brk_blk(arena, init);
 	}
 
-	// If 'init' is the last block, try to expand the heap
-	if (init->next == NULL) {
-		if (tail == heap_end)
-			return NULL;
-
-		void *ret_addr = sbrk(req_size - current->size);
-
-		DIE(ret_addr == (void *)-1, "Error at sbrk in expand realloc\n");
-
-		heap_end = (char *)heap_end + (req_size - current->size);
+	// Known only now, the block may end the heap since it took the free tail
+	int is_last = init == arena->last_brk;
 
-		set_meta(init, req_size, STATUS_ALLOC);
+	// Such a block grows with the heap too, rather than being copied to the end, unless a free block fits
+	if (is_last && (was_last || !find_best_in_bins(arena, req_size)) &&
+		arena_sbrk(arena, req_size - init->size) != (void *)-1) {
+		init->size = req_size;
+		mark_dirty(arena, init);
 		return init;
 	}
 
 	return NULL; // Expansion not possible
 }
 
+// Kept for the callers of the old helpers, the statistics are counted as the heap changes
 size_t get_available_heap_space(void)
 {
-	size_t total_free_space = 0;
-	struct block_meta *current = head;  // Assuming heap_start points to the start of your heap
+	struct osmem_stats stats;
 
-	while (current != NULL) {
-		if (current->status == STATUS_FREE)
-			total_free_space += current->size;
+	os_malloc_stats(&stats);
 
-		current = current->next;  // Assuming each block_meta has a pointer to the next block
-	}
-
-	return total_free_space;
+	return stats.free_bytes;
 }
 
 size_t get_block_count(void)
 {
-	size_t count = 0;
-	struct block_meta *current = head;
+	struct osmem_stats stats;
 
-	while (current != NULL) {
-		count++;
-		current = current->next;
-	}
+	os_malloc_stats(&stats);
 
-	return count;
+	return stats.block_count;
 }
 
 size_t get_largest_free_block_size(void)
 {
-	struct block_meta *current = head;
-	size_t max_size = 0;
-
-	while (current != NULL) {
-		if (current->status == STATUS_FREE && current->size > max_size)
-			max_size = current->size;
+	struct osmem_stats stats;
 
-		current = current->next;
-	}
+	os_malloc_stats(&stats);
 
-	return max_size; // Returns 0 if no free block is found
+	return stats.largest_free_block;
 }
 
 size_t get_used_space(void)
 {
-	size_t total_used = 0;
-	struct block_meta *current = head;
-
-	while (current != NULL) {
-		if (current->status != STATUS_FREE)
-			total_used += current->size;
+	struct osmem_stats stats;
 
-		current = current->next;
-	}
+	os_malloc_stats(&stats);
 
-	return total_used;
+	return stats.used_bytes;
 }
 
 size_t get_current_heap_size(void)
 {
-	if (head == NULL || tail == NULL)
-		return 0; // Heap is empty
+	struct osmem_stats stats;
 
-	// Assuming each block_meta includes the size of the block it represents
-	size_t heap_size = 0;
-	struct block_meta *current = head;
-
-	while (current != NULL) {
-		heap_size += current->size + sizeof(struct block_meta);
-		current = current->next;
-	}
+	os_malloc_stats(&stats);
 
-	return heap_size;
+	return stats.heap_size;
 }
@@ -6,16 +6,47 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <string.h>
+#include <pthread.h>
 
+#include "osmem.h"
 #include "block_meta.h"
 #include "os_utils.h"
 #include "block_meta_list.h"
+#include "arena.h"
 
-void *mmap_alloc(size_t blk_size);
+void lock_heap(void);
+
+void unlock_heap(void);
+
+void *mmap_alloc(size_t blk_size, int zero);
+
+void *mmap_align(size_t blk_size, size_t alignment);
+
+size_t get_mapping_size(struct block_meta *block);
+
+int unmap_blk(struct block_meta *block);
+
+struct block_meta *mremap_blk(struct block_meta *block, size_t blk_size);
 
 void *first_heap_alloc(size_t threshold);
 
-struct block_meta *new_heap(size_t blk_size);
+struct block_meta *new_heap(struct arena *arena, size_t blk_size);
+
+void mark_dirty(struct arena *arena, struct block_meta *block);
+
+size_t purge_blk(struct block_meta *block);
+
+size_t get_purged_dirty_size(struct block_meta *block, size_t size);
+
+struct block_meta *align_brk_blk(struct arena *arena, struct block_meta *block, size_t alignment, size_t size);
+
+size_t trim_arena(struct arena *arena, size_t pad);
+
+struct block_meta *alloc_brk_blk(struct arena *arena, size_t blk_size, size_t *dirty);
+
+size_t alloc_brk_batch(struct arena *arena, size_t blk_size, size_t count, void **ptrs);
+
+void release_brk_blk(struct block_meta *block);
 
 void set_meta(struct block_meta *new_block, size_t size, int status);
 
@@ -23,8 +54,8 @@ void *get_addr_from_blk(struct block_meta *block, size_t meta_size);
 
 struct block_meta *get_block_from_addr(void *ret_addr, size_t loc_blk_meta_size);
 
-struct block_meta *expand_realloc(struct block_meta *head, struct block_meta *init,
-                                  size_t req_size, size_t loc_blk_meta_size);
+struct block_meta *expand_realloc(struct arena *arena, struct block_meta *init, size_t req_size,
+								  size_t loc_blk_meta_size);
 
 size_t get_available_heap_space(void);
 
@@ -0,0 +1,321 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+#include <sched.h>
+
+#include "arena.h"
+#include "alloc_helpers.h"
+#include "percpu_cache.h"
+#include "slab.h"
+#include "compact_heap.h"
+#include "map_cache.h"
+
+extern struct arena main_arena;
+
+extern size_t blk_meta_size;
+
+extern int huge_pages;
+
+extern size_t huge_page_bytes;
+
+// Per-CPU arenas, their heaps share a single reservation
+static struct arena *cpu_arenas;
+static int nr_cpu_arenas;
+
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+
+void lock_arena(struct arena *arena)
+{
+	pthread_mutex_lock(&arena->lock);
+}
+
+void unlock_arena(struct arena *arena)
+{
+	pthread_mutex_unlock(&arena->lock);
+}
+
+int trylock_arena(struct arena *arena)
+{
+	return pthread_mutex_trylock(&arena->lock);
+}
+
+void push_remote_free(struct arena *arena, struct block_meta *block)
+{
+	struct block_meta *first = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+
+	// Blocks are only ever pushed one at a time and taken all at once, so there is no ABA
+	do {
+		block->next = first;
+	} while (!__atomic_compare_exchange_n(&arena->remote_frees, &first, block, 1,
+										  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void drain_remote_frees(struct arena *arena)
+{
+	if (!__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED))
+		return;
+
+	struct block_meta *block = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+
+	// The caller holds the lock of the arena
+	while (block) {
+		struct block_meta *next = block->next;
+
+		block->next = NULL;
+		free_brk_blk(arena, block, blk_meta_size);
+		block = next;
+	}
+}
+
+// Ask for huge pages on [start, end), count them only if the kernel supports it
+static void advise_huge(char *start, char *end)
+{
+	start = (char *)((uintptr_t)start & ~((uintptr_t)getpagesize() - 1));
+
+	if (start < end && !madvise(start, end - start, MADV_HUGEPAGE))
+		__atomic_add_fetch(&huge_page_bytes, end - start, __ATOMIC_RELAXED);
+}
+
+// The end of the memory the arena holds, in huge page mode it may be past the end of the heap
+static char *arena_top(struct arena *arena)
+{
+	return arena->huge_end > (char *)arena->heap_end ? arena->huge_end : (char *)arena->heap_end;
+}
+
+void *arena_sbrk(struct arena *arena, size_t increment)
+{
+	void *ret_addr;
+	int huge = __atomic_load_n(&huge_pages, __ATOMIC_RELAXED);
+
+	if (arena == &main_arena) {
+		size_t spare = arena_top(arena) - (char *)arena->heap_end;
+
+		// The rest of the last huge page is already there
+		if (increment <= spare) {
+			ret_addr = arena->heap_end;
+			goto out;
+		}
+
+		size_t grow = increment - spare;
+
+		// Move the break to a huge page boundary, so every huge page of the heap can be backed
+		if (huge) {
+			uintptr_t brk_end = (uintptr_t)sbrk(0);
+
+			grow = HUGE_ALIGN(brk_end + grow) - brk_end;
+		}
+
+		ret_addr = sbrk(grow);
+
+		// Out of memory, the heap is left as it was
+		if (ret_addr == ((void *) -1))
+			return ret_addr;
+
+		if (!arena->heap_start) {
+			arena->heap_start = ret_addr;
+			arena->heap_end = ret_addr;
+		}
+
+		if (huge) {
+			arena->huge_end = (char *)ret_addr + grow;
+			advise_huge(ret_addr, arena->huge_end);
+		}
+
+		if (spare)
+			ret_addr = arena->heap_end;
+	} else {
+		// A per-CPU heap never grows past its reservation
+		if ((size_t)((char *)arena->heap_limit - (char *)arena->heap_end) < increment)
+			return (void *) -1;
+
+		ret_addr = arena->heap_end;
+
+		// The reservation is already mapped, only ask for huge pages up to the next boundary
+		char *huge_end = (char *)HUGE_ALIGN((uintptr_t)arena->heap_end + increment);
+
+		if (huge && huge_end > arena->huge_end) {
+			if (huge_end > (char *)arena->heap_limit)
+				huge_end = arena->heap_limit;
+
+			advise_huge(arena_top(arena), huge_end);
+			arena->huge_end = huge_end;
+		}
+	}
+
+out:
+	arena->heap_end = (char *)arena->heap_end + increment;
+
+	return ret_addr;
+}
+
+int arena_can_shrink(struct arena *arena)
+{
+	// Someone else moved the program break, the heap no longer ends it
+	return arena != &main_arena || sbrk(0) == arena_top(arena);
+}
+
+void arena_shrink(struct arena *arena, size_t decrement)
+{
+	char *top = arena_top(arena);
+	char *end = (char *)arena->heap_end - decrement;
+
+	arena->heap_end = end;
+
+	// Huge pages are given back whole, the pages of the one the heap now ends in are only dropped
+	if (arena->huge_end > end) {
+		char *huge_end = (char *)HUGE_ALIGN((uintptr_t)end);
+
+		if (huge_end > top)
+			huge_end = top;
+
+		__atomic_sub_fetch(&huge_page_bytes, arena->huge_end - huge_end, __ATOMIC_RELAXED);
+		arena->huge_end = huge_end;
+
+		// The heap may grow over them again, they must read as zero
+		if (huge_end > end)
+			DIE(madvise(end, huge_end - end, MADV_DONTNEED) == -1, "Error at madvise in arena shrink\n");
+	}
+
+	if (arena == &main_arena) {
+		if (top > arena_top(arena))
+			DIE(sbrk(-(intptr_t)(top - arena_top(arena))) == ((void *) -1), "Error at sbrk in arena shrink\n");
+		return;
+	}
+
+	// A per-CPU heap keeps its reservation, only the pages are dropped
+	DIE(madvise(end, decrement, MADV_DONTNEED) == -1, "Error at madvise in arena shrink\n");
+}
+
+int init_cpu_arenas(void)
+{
+	int ret = 0;
+
+	lock_heap();
+
+	if (cpu_arenas)
+		goto out;
+
+	long count = sysconf(_SC_NPROCESSORS_CONF);
+
+	if (count < 1)
+		count = 1;
+
+	// Only the pages that get used are backed by memory
+	char *heaps = mmap(NULL, count * ARENA_HEAP_SIZE, PROT_READ | PROT_WRITE,
+					   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (heaps == (void *) -1) {
+		ret = -1;
+		goto out;
+	}
+
+	struct arena *arenas = mmap(NULL, count * sizeof(struct arena), PROT_READ | PROT_WRITE,
+								MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (arenas == (void *) -1 || init_cpu_caches(count)) {
+		munmap(heaps, count * ARENA_HEAP_SIZE);
+		if (arenas != (void *) -1)
+			munmap(arenas, count * sizeof(struct arena));
+		ret = -1;
+		goto out;
+	}
+
+	for (long i = 0; i < count; i++) {
+		pthread_mutex_init(&arenas[i].lock, NULL);
+		arenas[i].heap_start = heaps + i * ARENA_HEAP_SIZE;
+		arenas[i].heap_end = arenas[i].heap_start;
+		arenas[i].heap_limit = (char *)arenas[i].heap_start + ARENA_HEAP_SIZE;
+		arenas[i].index = i + 1;
+	}
+
+	nr_cpu_arenas = count;
+	__atomic_store_n(&cpu_arenas, arenas, __ATOMIC_RELEASE);
+
+out:
+	unlock_heap();
+
+	if (!ret)
+		register_fork_handlers();
+
+	return ret;
+}
+
+int is_arena_ptr(void *ptr)
+{
+	struct arena *arenas = __atomic_load_n(&cpu_arenas, __ATOMIC_ACQUIRE);
+
+	// The per-CPU heaps share a single reservation
+	if (arenas && (char *)ptr >= (char *)arenas[0].heap_start &&
+		(char *)ptr < (char *)arenas[0].heap_start + nr_cpu_arenas * ARENA_HEAP_SIZE)
+		return 1;
+
+	return ptr > __atomic_load_n(&main_arena.heap_start, __ATOMIC_RELAXED) &&
+		   ptr < __atomic_load_n(&main_arena.heap_end, __ATOMIC_RELAXED);
+}
+
+int get_arena_count(void)
+{
+	// The main arena comes first, followed by the per-CPU ones
+	if (!__atomic_load_n(&cpu_arenas, __ATOMIC_ACQUIRE))
+		return 1;
+
+	return nr_cpu_arenas + 1;
+}
+
+struct arena *get_arena(int index)
+{
+	if (index <= 0 || index >= get_arena_count())
+		return &main_arena;
+
+	return &cpu_arenas[index - 1];
+}
+
+struct arena *get_cpu_arena(int cpu)
+{
+	return get_arena(cpu + 1);
+}
+
+struct arena *get_current_arena(void)
+{
+	return get_cpu_arena(sched_getcpu());
+}
+
+struct arena *get_blk_arena(struct block_meta *block)
+{
+	// Heap blocks are tagged with their arena when they are handed out
+	return get_arena(block->owner);
+}
+
+static void lock_all(void)
+{
+	// Class locks are taken before the heap lock everywhere
+	lock_map_cache();
+	lock_slabs();
+	lock_compact_heap();
+	lock_heap();
+
+	for (int i = 0; i < get_arena_count(); i++)
+		lock_arena(get_arena(i));
+}
+
+static void unlock_all(void)
+{
+	for (int i = get_arena_count() - 1; i >= 0; i--)
+		unlock_arena(get_arena(i));
+
+	unlock_heap();
+	unlock_compact_heap();
+	unlock_slabs();
+	unlock_map_cache();
+}
+
+static void register_fork_handlers_once(void)
+{
+	DIE(pthread_atfork(lock_all, unlock_all, unlock_all), "Error at pthread_atfork\n");
+}
+
+void register_fork_handlers(void)
+{
+	// Keep every lock consistent in the child of a fork
+	pthread_once(&fork_once, register_fork_handlers_once);
+}
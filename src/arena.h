@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "block_meta.h"
+#include "os_utils.h"
+#include "osmem.h"
+#include "free_bins.h"
+
+// Address space reserved for the heap of every per-CPU arena
+#define ARENA_HEAP_SIZE (64UL * 1024 * 1024)
+
+// Statistics are only changed under the arena lock, os_malloc_stats() reads them without it
+#define ARENA_STAT_SET(counter, value) __atomic_store_n(&(counter), (value), __ATOMIC_RELAXED)
+#define ARENA_STAT_ADD(counter, delta) ARENA_STAT_SET(counter, (counter) + (delta))
+
+// Heap state, the main arena grows with brk, per-CPU ones inside their reservation
+struct arena {
+	pthread_mutex_t lock;
+
+	// Free blocks of each size class, kept sorted by size, then by address
+	struct block_meta *bins[NUM_BINS];
+
+	// One bit for every non-empty bin
+	uint64_t bin_map[BIN_MAP_WORDS];
+
+	// Free blocks too big for the bins, ordered by size, then by address
+	struct block_meta *free_tree;
+
+	void *heap_start;
+	void *heap_end;
+	void *heap_limit;
+
+	struct block_meta *last_brk;
+
+	// Memory from here on was never handed out, so it is still zero
+	char *zero_start;
+
+	// In huge page mode, the heap is backed in whole huge pages up to here
+	char *huge_end;
+
+	// Blocks freed by threads that did not take the lock, linked through 'next'
+	struct block_meta *remote_frees;
+
+	// Heap blocks, and what the free ones hold
+	size_t nr_blocks;
+	size_t free_bytes;
+	size_t largest_free;
+	size_t class_free_blocks[OSMEM_STATS_CLASSES];
+	size_t class_free_bytes[OSMEM_STATS_CLASSES];
+
+	// Position of the arena, stored in the header of its blocks
+	int index;
+};
+
+void lock_arena(struct arena *arena);
+
+void unlock_arena(struct arena *arena);
+
+int trylock_arena(struct arena *arena);
+
+void push_remote_free(struct arena *arena, struct block_meta *block);
+
+void drain_remote_frees(struct arena *arena);
+
+void *arena_sbrk(struct arena *arena, size_t increment);
+
+int arena_can_shrink(struct arena *arena);
+
+void arena_shrink(struct arena *arena, size_t decrement);
+
+int init_cpu_arenas(void);
+
+struct arena *get_arena(int index);
+
+struct arena *get_cpu_arena(int cpu);
+
+struct arena *get_current_arena(void);
+
+struct arena *get_blk_arena(struct block_meta *block);
+
+int is_arena_ptr(void *ptr);
+
+int get_arena_count(void);
+
+void register_fork_handlers(void);
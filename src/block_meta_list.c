@@ -1,125 +1,176 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
 #include "block_meta_list.h"
+#ifdef OSMEM_PRELOAD
+#include "page_map.h"
+#endif
 
-extern struct block_meta *tail;
+extern size_t blk_meta_size;
 
-extern void *heap_end;
+extern size_t trim_threshold;
 
-void add_in_list(struct block_meta **head, struct block_meta **tail, struct block_meta *new_block, int status)
+extern size_t purge_threshold;
+
+extern size_t mapped_count;
+
+extern size_t mapped_bytes;
+
+// The mapped statistics are changed with the heap lock held, like the list
+void add_mapped_blk(struct block_meta **list, struct block_meta *new_block)
 {
-	// Insertion when head is NULL
-	if (*head == NULL) {
-		*head = new_block;
-		*tail = new_block;
-		new_block->prev = NULL;
-		new_block->next = NULL;
-		return;
-	}
+	__atomic_store_n(&mapped_count, mapped_count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&mapped_bytes, mapped_bytes + new_block->size, __ATOMIC_RELAXED);
 
-	// Insertion when head is STATUS_MAPPED
-	if ((*head)->status == STATUS_MAPPED) {
-		if (status == STATUS_MAPPED) {
-			// Inserting another STATUS_MAPPED after head
-			new_block->next = (*head)->next;
-			new_block->prev = *head;
-
-			// Update the next block's prev
-			if ((*head)->next != NULL)
-				(*head)->next->prev = new_block;
-			else
-				*tail = new_block; // Update tail if we're at the end
-
-		} else {
-			// Inserting a STATUS_ALLOC before head
-			new_block->next = *head;
-			new_block->prev = NULL;
-			(*head)->prev = new_block;
-			*head = new_block; // Update head
-		}
-		return;
-	}
+#ifdef OSMEM_PRELOAD
+	// free() looks the payload up here to tell the block apart from a foreign pointer
+	page_map_set(get_addr_from_blk(new_block, blk_meta_size));
+#endif
+
+	// Mapped blocks are never searched, so they are simply pushed at the front
+	new_block->prev = NULL;
+	new_block->next = *list;
 
-	struct block_meta *current = *head;
+	if (*list)
+		(*list)->prev = new_block;
 
-	if (status == STATUS_MAPPED) {
-		// Find the last node in the list to add the STATUS_MAPPED block
-		while (current->next != NULL)
-			current = current->next;
+	*list = new_block;
+}
+
+void remove_mapped_blk(struct block_meta **list, struct block_meta *block)
+{
+	__atomic_store_n(&mapped_count, mapped_count - 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&mapped_bytes, mapped_bytes - block->size, __ATOMIC_RELAXED);
 
+#ifdef OSMEM_PRELOAD
+	page_map_clear(get_addr_from_blk(block, blk_meta_size));
+#endif
 
-		current->next = new_block;
-		new_block->prev = current;
-		new_block->next = NULL;
-		*tail = new_block; // Update tail
-	} else if (status == STATUS_ALLOC) {
-		// Find the position to insert the STATUS_ALLOC block before any STATUS_MAPPED block
-		while (current->next != NULL && current->next->status != STATUS_MAPPED)
-			current = current->next;
+	if (block->prev)
+		block->prev->next = block->next;
+	else
+		*list = block->next;
 
-		new_block->next = current->next;
-		new_block->prev = current;
-		current->next = new_block;
+	if (block->next)
+		block->next->prev = block->prev;
 
-		// Update the next node's prev and possibly the tail
-		if (current->next->next != NULL)
-			current->next->next->prev = new_block;
-		else
-			*tail = new_block; // Update tail if we're at the end
-	}
+	block->prev = NULL;
+	block->next = NULL;
 }
 
+struct block_meta *first_brk_blk(struct arena *arena)
+{
+	// An arena that never grew has no blocks
+	if (arena->heap_start == arena->heap_end)
+		return NULL;
+
+	return arena->heap_start;
+}
 
-struct block_meta *find_block_with_size(struct block_meta *head, size_t needed_size, size_t loc_blk_meta_size)
+struct block_meta *get_next_brk_blk(struct arena *arena, struct block_meta *block)
 {
-	// Return NULL if the list is empty
-	if (!head)
+	// Heap blocks are contiguous, the next one starts right after the payload
+	char *next_addr = (char *)block + blk_meta_size + block->size;
+
+	if ((void *)next_addr >= arena->heap_end)
 		return NULL;
 
-	// Merge consecutive free blocks
-	for (struct block_meta *current = head; current && current->next; ) {
-		if (current && current->next) {
-			if (current->status == STATUS_FREE && current->next->status == STATUS_FREE) {
-				// Merge current and next blocks
-				current->size += current->next->size + loc_blk_meta_size;
-				current->next = current->next->next;
-			} else {
-				// Move to the next block
-				current = current->next;
-			}
-		}
+	return (struct block_meta *)next_addr;
+}
+
+struct block_meta *get_prev_free_blk(struct block_meta *block)
+{
+	// An allocated block links back to the block before it only if that one is free
+	return block->prev;
+}
+
+void update_boundary_tag(struct arena *arena, struct block_meta *block)
+{
+	struct block_meta *next = get_next_brk_blk(arena, block);
+
+	// The links of a free block belong to its bin, only allocated ones are tagged
+	if (!next || next->status != STATUS_ALLOC)
+		return;
+
+	next->prev = block->status == STATUS_FREE ? block : NULL;
+}
+
+void free_brk_blk(struct arena *arena, struct block_meta *block, size_t loc_blk_meta_size)
+{
+	struct block_meta *next = get_next_brk_blk(arena, block);
+	struct block_meta *prev = get_prev_free_blk(block);
+
+	block->status = STATUS_FREE;
+
+	// Merge with the next block if it is free
+	if (next && next->status == STATUS_FREE) {
+		remove_from_bin(arena, next);
+		block->size += next->size + loc_blk_meta_size;
+		ARENA_STAT_ADD(arena->nr_blocks, -1);
+		block->flags &= ~BLOCK_PURGED;
+
+		if (next == arena->last_brk)
+			arena->last_brk = block;
+	}
+
+	// Merge into the previous block if it is free
+	if (prev) {
+		remove_from_bin(arena, prev);
+		prev->size += block->size + loc_blk_meta_size;
+		ARENA_STAT_ADD(arena->nr_blocks, -1);
+		prev->flags &= ~BLOCK_PURGED;
+
+		if (block == arena->last_brk)
+			arena->last_brk = prev;
+
+		block = prev;
 	}
 
-	// Find the best fitting block
-	struct block_meta *best_fit = NULL;
+	update_boundary_tag(arena, block);
+	add_in_bin(arena, block);
 
-	for (struct block_meta *current = head; current; current = current->next) {
-		if (current->status == STATUS_FREE && current->size >= needed_size) {
-			if (!best_fit || current->size < best_fit->size)
-				best_fit = current;
-		}
+	// Give a large free tail back to the OS
+	if (block == arena->last_brk && trim_threshold && block->size >= trim_threshold) {
+		trim_arena(arena, 0);
+		return;
 	}
 
+	// Drop the pages inside a large free block, its header and links stay in place
+	if (purge_threshold && block->size >= purge_threshold)
+		purge_blk(block);
+}
+
+struct block_meta *find_block_with_size(struct arena *arena, size_t needed_size, size_t loc_blk_meta_size,
+										size_t *dirty)
+{
+	// Without more knowledge, everything may hold old data
+	*dirty = needed_size;
+
+	// Return NULL if the heap is empty
+	if (arena->heap_start == arena->heap_end)
+		return NULL;
+
+	// Find the best fitting block, free blocks are already coalesced when freed
+	struct block_meta *best_fit = find_best_in_bins(arena, needed_size);
+
 	if (best_fit) {
 		// Allocate the best fitting block
+		remove_from_bin(arena, best_fit);
 		best_fit->status = STATUS_ALLOC;
-		return split_blk(best_fit, needed_size, loc_blk_meta_size);
+		update_boundary_tag(arena, best_fit);
+		*dirty = get_purged_dirty_size(best_fit, needed_size);
+		return split_blk(arena, best_fit, needed_size, loc_blk_meta_size);
 	}
 
 	// Attempt to expand the last block if it's free
-	struct block_meta *last_block = get_last_brk_blk(head);
+	struct block_meta *last_block = arena->last_brk;
 
 	if (last_block && last_block->status == STATUS_FREE) {
-		void *expansion = sbrk(needed_size - last_block->size);
+		void *expansion = arena_sbrk(arena, needed_size - last_block->size);
 
 		if (expansion == (void *) -1)
 			return NULL; // Expansion failed
 
-		heap_end = (char *)heap_end + (needed_size - last_block->size);
-
-		// TODO check if this is correct
-		tail = (struct block_meta *)(tail + (needed_size - last_block->size));
-
+		remove_from_bin(arena, last_block);
 		set_meta(last_block, needed_size, STATUS_ALLOC);
 		return last_block;
 	}
@@ -128,7 +179,7 @@ struct block_meta *find_block_with_size(struct block_meta *head, size_t needed_s
 	return NULL;
 }
 
-struct block_meta *split_blk(struct block_meta *initial, size_t req_size, size_t loc_blk_meta_size)
+struct block_meta *split_blk(struct arena *arena, struct block_meta *initial, size_t req_size, size_t loc_blk_meta_size)
 {
 	// Ensure the block is large enough to be split
 	int large_block = initial->size >= req_size + ALIGN(1) + loc_blk_meta_size;
@@ -138,72 +189,23 @@ struct block_meta *split_blk(struct block_meta *initial, size_t req_size, size_t
 		char *new_block_addr = (char *)initial + req_size + loc_blk_meta_size;
 		struct block_meta *new_block = (struct block_meta *)(new_block_addr);
 
-		// Configure the new block
-		new_block->size = initial->size - req_size - loc_blk_meta_size;
-		new_block->status = STATUS_FREE;
-		new_block->next = initial->next;
-		new_block->prev = initial; // Set the previous pointer to the initial block
+		// Configure the new block, its whole pages are still purged if the initial ones were
+		set_meta(new_block, initial->size - req_size - loc_blk_meta_size, STATUS_ALLOC);
+		new_block->flags = initial->flags & BLOCK_PURGED;
+		ARENA_STAT_ADD(arena->nr_blocks, 1);
 
 		// Update the initial block
 		initial->size = req_size;
 		initial->status = STATUS_ALLOC;
-		initial->next = new_block;
 
-		// Update the previous pointer of the next block in the list, if it exists
-		if (new_block->next)
-			new_block->next->prev = new_block;
+		// The remainder becomes the last heap block if the initial one was
+		if (initial == arena->last_brk)
+			arena->last_brk = new_block;
+
+		// Make the remainder reusable, merging it with a free block that follows
+		free_brk_blk(arena, new_block, loc_blk_meta_size);
 	}
 
 	// Return the initial block, now resized
 	return initial;
 }
-
-struct block_meta *get_last_brk_blk(struct block_meta *head)
-{
-	struct block_meta *current = head;
-
-	// Iterating through the list to locate the last block before any mmaped block
-	while (current->next) {
-		// If the next block is mmaped, we have reached the last non-mmaped block
-		if (current->next && current->next->status == STATUS_MAPPED)
-			return current; // This is the last block managed by brk/sbrk
-
-		current = current->next;
-	}
-
-	// Check if the found block is either allocated or free
-	// If so, this block is the last block managed by brk/sbrk system
-	if (current && (current->status == STATUS_ALLOC || current->status == STATUS_FREE))
-		return current;  // Return the last brk/sbrk managed block
-
-	// If no such block is found, return NULL
-	return NULL;
-}
-
-void remove_from_list(struct block_meta **head, struct block_meta **tail, struct block_meta *current)
-{
-	// If the list is empty or current is NULL, there's nothing to delete
-	if (*head == NULL || current == NULL)
-		return;
-
-	// If the node to be deleted is the head node
-	if (*head == current) {
-		*head = current->next;
-		// If there's a next node, update its prev pointer
-		if (current->next != NULL) {
-			current->next->prev = NULL;
-		} else {
-			// If there's no next node, then the list is now empty
-			*tail = NULL;
-		}
-	} else if (*tail == current) { // If the node to be deleted is the tail node
-		*tail = current->prev;
-		if (current->prev != NULL)
-			current->prev->next = NULL;
-
-	} else { // If the node is in the middle of the list
-		current->prev->next = current->next;
-		if (current->next != NULL)
-			current->next->prev = current->prev;
-	}
-}
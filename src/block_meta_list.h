@@ -10,13 +10,24 @@
 #include "block_meta.h"
 #include "os_utils.h"
 #include "alloc_helpers.h"
+#include "free_bins.h"
+#include "arena.h"
 
-void add_in_list(struct block_meta **head, struct block_meta **tail, struct block_meta *new_block, int status);
+void add_mapped_blk(struct block_meta **list, struct block_meta *new_block);
 
-void remove_from_list(struct block_meta **head, struct block_meta **tail, struct block_meta *current);
+void remove_mapped_blk(struct block_meta **list, struct block_meta *block);
 
-struct block_meta *find_block_with_size(struct block_meta *head, size_t needed_size, size_t loc_blk_meta_size);
+struct block_meta *find_block_with_size(struct arena *arena, size_t needed_size, size_t loc_blk_meta_size,
+										size_t *dirty);
 
-struct block_meta *get_last_brk_blk(struct block_meta *head);
+struct block_meta *first_brk_blk(struct arena *arena);
 
-struct block_meta *split_blk(struct block_meta *initial, size_t needed_size, size_t loc_blk_meta_size);
+struct block_meta *get_next_brk_blk(struct arena *arena, struct block_meta *block);
+
+struct block_meta *get_prev_free_blk(struct block_meta *block);
+
+void update_boundary_tag(struct arena *arena, struct block_meta *block);
+
+void free_brk_blk(struct arena *arena, struct block_meta *block, size_t loc_blk_meta_size);
+
+struct block_meta *split_blk(struct arena *arena, struct block_meta *initial, size_t needed_size, size_t loc_blk_meta_size);
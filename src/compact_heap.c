@@ -0,0 +1,328 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "compact_heap.h"
+#include "alloc_helpers.h"
+#include "arena.h"
+
+static struct compact_heap compact_heap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// The statistics are only changed under the lock of the compact heap
+#define COMPACT_STAT_ADD(counter, delta) __atomic_store_n(&(counter), (counter) + (delta), __ATOMIC_RELAXED)
+
+int init_compact_heap(void)
+{
+	int ret = 0;
+
+	lock_heap();
+
+	if (compact_heap.start)
+		goto out;
+
+	// Only the pages that get used are backed by memory
+	char *mem = mmap(NULL, COMPACT_HEAP_SIZE, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (mem == (void *) -1) {
+		ret = -1;
+		goto out;
+	}
+
+	compact_heap.top = mem;
+	compact_heap.zero_start = mem;
+	compact_heap.limit = mem + COMPACT_HEAP_SIZE;
+	__atomic_store_n(&compact_heap.start, mem, __ATOMIC_RELEASE);
+
+out:
+	unlock_heap();
+
+	if (!ret)
+		register_fork_handlers();
+
+	return ret;
+}
+
+int is_compact_ptr(void *ptr)
+{
+	char *start = __atomic_load_n(&compact_heap.start, __ATOMIC_ACQUIRE);
+
+	return start && (char *)ptr >= start && (char *)ptr < start + COMPACT_HEAP_SIZE;
+}
+
+static size_t chunk_size(struct compact_chunk *chunk)
+{
+	return chunk->header & ~(size_t)CHUNK_FLAGS;
+}
+
+static struct compact_chunk *next_chunk(struct compact_chunk *chunk)
+{
+	return (struct compact_chunk *)((char *)chunk + COMPACT_HEADER_SIZE + chunk_size(chunk));
+}
+
+static struct compact_chunk *get_chunk(void *ptr)
+{
+	return (struct compact_chunk *)((char *)ptr - COMPACT_HEADER_SIZE);
+}
+
+static void insert_free(struct compact_chunk *chunk)
+{
+	size_t class = get_size_class(chunk_size(chunk));
+
+	chunk->prev = NULL;
+	chunk->next = compact_heap.bins[class];
+
+	if (chunk->next)
+		chunk->next->prev = chunk;
+
+	compact_heap.bins[class] = chunk;
+	compact_heap.bin_map[class / 64] |= (uint64_t)1 << (class % 64);
+	COMPACT_STAT_ADD(compact_heap.free_bytes, chunk_size(chunk));
+}
+
+static void remove_free(struct compact_chunk *chunk)
+{
+	size_t class = get_size_class(chunk_size(chunk));
+
+	if (chunk->prev)
+		chunk->prev->next = chunk->next;
+	else
+		compact_heap.bins[class] = chunk->next;
+
+	if (chunk->next)
+		chunk->next->prev = chunk->prev;
+
+	if (!compact_heap.bins[class])
+		compact_heap.bin_map[class / 64] &= ~((uint64_t)1 << (class % 64));
+
+	COMPACT_STAT_ADD(compact_heap.free_bytes, -chunk_size(chunk));
+}
+
+static struct compact_chunk *find_free(size_t size)
+{
+	size_t class = get_size_class(size);
+
+	// The bin of the requested size may hold smaller chunks of the same range
+	for (struct compact_chunk *current = compact_heap.bins[class]; current; current = current->next) {
+		if (chunk_size(current) >= size)
+			return current;
+	}
+
+	// Any chunk of a bigger class fits
+	for (size_t word = (class + 1) / 64; word < BIN_MAP_WORDS; word++) {
+		uint64_t map = compact_heap.bin_map[word];
+
+		if (word == (class + 1) / 64)
+			map &= ~(uint64_t)0 << ((class + 1) % 64);
+
+		if (map)
+			return compact_heap.bins[word * 64 + __builtin_ctzll(map)];
+	}
+
+	return NULL;
+}
+
+// Merge a chunk with its free neighbours, then give it back to the bins or to the top
+static void release_chunk(struct compact_chunk *chunk)
+{
+	size_t size = chunk_size(chunk);
+	struct compact_chunk *next = next_chunk(chunk);
+
+	if ((char *)next != compact_heap.top && !(next->header & CHUNK_IN_USE)) {
+		remove_free(next);
+		size += COMPACT_HEADER_SIZE + chunk_size(next);
+		COMPACT_STAT_ADD(compact_heap.nr_chunks, -1);
+	}
+
+	// The size of a free chunk is repeated in its last word
+	if (!(chunk->header & CHUNK_PREV_IN_USE)) {
+		size_t prev_size = *(size_t *)((char *)chunk - sizeof(size_t));
+		struct compact_chunk *prev = (struct compact_chunk *)((char *)chunk - COMPACT_HEADER_SIZE - prev_size);
+
+		remove_free(prev);
+		size += COMPACT_HEADER_SIZE + prev_size;
+		chunk = prev;
+		COMPACT_STAT_ADD(compact_heap.nr_chunks, -1);
+	}
+
+	// Two free chunks are never adjacent, so the one before is in use
+	chunk->header = size | CHUNK_PREV_IN_USE;
+
+	next = next_chunk(chunk);
+	if ((char *)next == compact_heap.top) {
+		compact_heap.top = (char *)chunk;
+		COMPACT_STAT_ADD(compact_heap.nr_chunks, -1);
+		return;
+	}
+
+	*(size_t *)((char *)next - sizeof(size_t)) = size;
+	next->header &= ~(size_t)CHUNK_PREV_IN_USE;
+	insert_free(chunk);
+}
+
+static void split_chunk(struct compact_chunk *chunk, size_t size)
+{
+	size_t old_size = chunk_size(chunk);
+
+	if (old_size < size + COMPACT_HEADER_SIZE + COMPACT_MIN_SIZE)
+		return;
+
+	struct compact_chunk *rest = (struct compact_chunk *)((char *)chunk + COMPACT_HEADER_SIZE + size);
+
+	chunk->header = size | (chunk->header & CHUNK_FLAGS);
+	rest->header = (old_size - size - COMPACT_HEADER_SIZE) | CHUNK_IN_USE | CHUNK_PREV_IN_USE;
+	COMPACT_STAT_ADD(compact_heap.nr_chunks, 1);
+	release_chunk(rest);
+}
+
+static void raise_zero_start(void)
+{
+	if (compact_heap.top > compact_heap.zero_start)
+		compact_heap.zero_start = compact_heap.top;
+}
+
+void *compact_alloc(size_t size, int zero)
+{
+	struct compact_chunk *chunk;
+	size_t dirty = 0;
+
+	if (size < COMPACT_MIN_SIZE)
+		size = COMPACT_MIN_SIZE;
+
+	pthread_mutex_lock(&compact_heap.lock);
+
+	chunk = find_free(size);
+
+	if (chunk) {
+		remove_free(chunk);
+		chunk->header |= CHUNK_IN_USE;
+		next_chunk(chunk)->header |= CHUNK_PREV_IN_USE;
+		split_chunk(chunk, size);
+		dirty = size;
+	} else if ((size_t)(compact_heap.limit - compact_heap.top) >= COMPACT_HEADER_SIZE + size) {
+		chunk = (struct compact_chunk *)compact_heap.top;
+		chunk->header = size | CHUNK_IN_USE | CHUNK_PREV_IN_USE;
+
+		// The top may have moved down over chunks that were used before
+		if ((char *)chunk + COMPACT_HEADER_SIZE < compact_heap.zero_start)
+			dirty = compact_heap.zero_start - ((char *)chunk + COMPACT_HEADER_SIZE);
+
+		compact_heap.top = (char *)next_chunk(chunk);
+		raise_zero_start();
+		COMPACT_STAT_ADD(compact_heap.nr_chunks, 1);
+	}
+
+	pthread_mutex_unlock(&compact_heap.lock);
+
+	if (!chunk)
+		return NULL;
+
+	void *ptr = (char *)chunk + COMPACT_HEADER_SIZE;
+
+	if (zero && dirty)
+		memset(ptr, 0, dirty < size ? dirty : size);
+
+	return ptr;
+}
+
+void compact_free(void *ptr)
+{
+	struct compact_chunk *chunk = get_chunk(ptr);
+
+	pthread_mutex_lock(&compact_heap.lock);
+
+	// Ignore chunks that are already free
+	if (chunk->header & CHUNK_IN_USE)
+		release_chunk(chunk);
+
+	pthread_mutex_unlock(&compact_heap.lock);
+}
+
+int compact_resize(void *ptr, size_t size)
+{
+	struct compact_chunk *chunk = get_chunk(ptr);
+	int ret = 1;
+
+	if (size < COMPACT_MIN_SIZE)
+		size = COMPACT_MIN_SIZE;
+
+	pthread_mutex_lock(&compact_heap.lock);
+
+	struct compact_chunk *next = next_chunk(chunk);
+	size_t old_size = chunk_size(chunk);
+
+	if (size <= old_size) {
+		split_chunk(chunk, size);
+	} else if ((char *)next == compact_heap.top) {
+		// The last chunk grows into the unused part of the reservation
+		if ((size_t)(compact_heap.limit - (char *)chunk) - COMPACT_HEADER_SIZE >= size) {
+			chunk->header = size | (chunk->header & CHUNK_FLAGS);
+			compact_heap.top = (char *)next_chunk(chunk);
+			raise_zero_start();
+		} else {
+			ret = 0;
+		}
+	} else if (!(next->header & CHUNK_IN_USE) &&
+			   old_size + COMPACT_HEADER_SIZE + chunk_size(next) >= size) {
+		remove_free(next);
+		chunk->header = (old_size + COMPACT_HEADER_SIZE + chunk_size(next)) | (chunk->header & CHUNK_FLAGS);
+		COMPACT_STAT_ADD(compact_heap.nr_chunks, -1);
+		next_chunk(chunk)->header |= CHUNK_PREV_IN_USE;
+		split_chunk(chunk, size);
+	} else {
+		ret = 0;
+	}
+
+	pthread_mutex_unlock(&compact_heap.lock);
+
+	return ret;
+}
+
+size_t compact_usable_size(void *ptr)
+{
+	return chunk_size(get_chunk(ptr));
+}
+
+void add_compact_stats(struct osmem_stats *stats)
+{
+	char *start = __atomic_load_n(&compact_heap.start, __ATOMIC_ACQUIRE);
+
+	if (!start)
+		return;
+
+	// The chunks cover the heap from its start to the top
+	size_t span = (char *)__atomic_load_n(&compact_heap.top, __ATOMIC_RELAXED) - start;
+	size_t chunks = __atomic_load_n(&compact_heap.nr_chunks, __ATOMIC_RELAXED);
+	size_t free_bytes = __atomic_load_n(&compact_heap.free_bytes, __ATOMIC_RELAXED);
+
+	stats->heap_size += span;
+	stats->block_count += chunks;
+	stats->free_bytes += free_bytes;
+	if (span > chunks * COMPACT_HEADER_SIZE + free_bytes)
+		stats->used_bytes += span - chunks * COMPACT_HEADER_SIZE - free_bytes;
+}
+
+struct compact_chunk *first_compact_chunk(void)
+{
+	char *start = __atomic_load_n(&compact_heap.start, __ATOMIC_ACQUIRE);
+
+	if (!start || start == compact_heap.top)
+		return NULL;
+
+	return (struct compact_chunk *)start;
+}
+
+struct compact_chunk *get_next_compact_chunk(struct compact_chunk *chunk)
+{
+	struct compact_chunk *next = next_chunk(chunk);
+
+	return (char *)next < compact_heap.top ? next : NULL;
+}
+
+void lock_compact_heap(void)
+{
+	pthread_mutex_lock(&compact_heap.lock);
+}
+
+void unlock_compact_heap(void)
+{
+	pthread_mutex_unlock(&compact_heap.lock);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "block_meta.h"
+#include "os_utils.h"
+#include "osmem.h"
+#include "free_bins.h"
+
+/*
+ * Chunks of the compact heap only carry a size word. Its low bits hold the
+ * status of the chunk and of the one before it, the links of a free chunk and
+ * the copy of its size used for coalescing live in its own payload.
+ */
+#define CHUNK_IN_USE      1
+#define CHUNK_PREV_IN_USE 2
+#define CHUNK_FLAGS       (ALIGNMENT - 1)
+
+#define COMPACT_HEADER_SIZE sizeof(size_t)
+
+// A free chunk must fit its two links and its size at the end
+#define COMPACT_MIN_SIZE (3 * sizeof(size_t))
+
+// Address space reserved for the compact heap
+#define COMPACT_HEAP_SIZE (1024UL * 1024 * 1024)
+
+struct compact_chunk {
+	size_t header;
+
+	// Only valid while the chunk is free
+	struct compact_chunk *prev;
+	struct compact_chunk *next;
+};
+
+struct compact_heap {
+	pthread_mutex_t lock;
+
+	struct compact_chunk *bins[NUM_BINS];
+	uint64_t bin_map[BIN_MAP_WORDS];
+
+	// Chunks are carved at 'top', the chunk before it is always in use
+	char *start;
+	char *top;
+	char *limit;
+
+	// Highest top so far, the memory above it is still zero
+	char *zero_start;
+
+	// Chunks below the top and the payload of the free ones, os_malloc_stats() reads them without the lock
+	size_t nr_chunks;
+	size_t free_bytes;
+};
+
+int init_compact_heap(void);
+
+int is_compact_ptr(void *ptr);
+
+void *compact_alloc(size_t size, int zero);
+
+void compact_free(void *ptr);
+
+int compact_resize(void *ptr, size_t size);
+
+size_t compact_usable_size(void *ptr);
+
+void add_compact_stats(struct osmem_stats *stats);
+
+// The chunks below the top in address order, free ones included
+struct compact_chunk *first_compact_chunk(void);
+
+struct compact_chunk *get_next_compact_chunk(struct compact_chunk *chunk);
+
+void lock_compact_heap(void);
+
+void unlock_compact_heap(void);
@@ -0,0 +1,189 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "free_bins.h"
+#include "arena.h"
+#include "free_tree.h"
+
+// Size class for every aligned size below TREE_MIN_SIZE
+static unsigned char size_class_table[TREE_MIN_SIZE / ALIGNMENT];
+
+static int size_class_table_ready;
+
+static size_t compute_size_class(size_t size)
+{
+	if (size <= SMALL_BIN_LIMIT)
+		return size / ALIGNMENT - 1;
+
+	if (size >= TREE_MIN_SIZE)
+		return NUM_BINS - 1;
+
+	// Split every power of two in BINS_PER_POW2 equal ranges
+	int pow2 = 63 - __builtin_clzl(size);
+	size_t range = ((size_t)1 << pow2) / BINS_PER_POW2;
+	size_t sub_bin = (size - ((size_t)1 << pow2)) / range;
+
+	return NUM_SMALL_BINS + (pow2 - 10) * BINS_PER_POW2 + sub_bin;
+}
+
+static void init_size_class_table(void)
+{
+	for (size_t i = 1; i < TREE_MIN_SIZE / ALIGNMENT; i++)
+		size_class_table[i] = compute_size_class(i * ALIGNMENT);
+
+	__atomic_store_n(&size_class_table_ready, 1, __ATOMIC_RELEASE);
+}
+
+// Power of two class of struct osmem_stats
+static size_t get_stats_class(size_t size)
+{
+	if (size < 16)
+		return 0;
+
+	size_t class = 63 - __builtin_clzl(size) - 3;
+
+	return class < OSMEM_STATS_CLASSES ? class : OSMEM_STATS_CLASSES - 1;
+}
+
+// Every free block is in a bin, so the statistics of the free blocks only change here
+static void count_free_blk(struct arena *arena, struct block_meta *block, int delta)
+{
+	size_t class = get_stats_class(block->size);
+
+	ARENA_STAT_ADD(arena->free_bytes, delta * block->size);
+	ARENA_STAT_ADD(arena->class_free_blocks[class], delta);
+	ARENA_STAT_ADD(arena->class_free_bytes[class], delta * block->size);
+}
+
+static size_t find_largest_free(struct arena *arena)
+{
+	// Every block of the tree is bigger than the ones in the bins
+	if (arena->free_tree)
+		return tree_max(arena->free_tree)->size;
+
+	for (int word = BIN_MAP_WORDS - 1; word >= 0; word--) {
+		if (!arena->bin_map[word])
+			continue;
+
+		size_t class = word * 64 + 63 - __builtin_clzll(arena->bin_map[word]);
+		struct block_meta *last = arena->bins[class];
+
+		// Exact bins hold a single size, the ranged ones end with their biggest block
+		if (class < NUM_SMALL_BINS)
+			return (class + 1) * ALIGNMENT;
+
+		while (last->next)
+			last = last->next;
+
+		return last->size;
+	}
+
+	return 0;
+}
+
+size_t get_size_class(size_t size)
+{
+	if (size >= TREE_MIN_SIZE)
+		return NUM_BINS - 1;
+
+	if (!__atomic_load_n(&size_class_table_ready, __ATOMIC_ACQUIRE))
+		init_size_class_table();
+
+	return size_class_table[size / ALIGNMENT];
+}
+
+void add_in_bin(struct arena *arena, struct block_meta *block)
+{
+	count_free_blk(arena, block, 1);
+	if (block->size > arena->largest_free)
+		ARENA_STAT_SET(arena->largest_free, block->size);
+
+	if (block->size >= TREE_MIN_SIZE) {
+		arena->free_tree = tree_insert(arena->free_tree, block);
+		return;
+	}
+
+	size_t class = get_size_class(block->size);
+	struct block_meta *prev = NULL;
+	struct block_meta *current = arena->bins[class];
+
+	// Exact bins hold a single size, so this only walks blocks of the same size
+	while (current && (current->size < block->size ||
+					   (current->size == block->size && current < block))) {
+		prev = current;
+		current = current->next;
+	}
+
+	block->prev = prev;
+	block->next = current;
+
+	if (current)
+		current->prev = block;
+
+	if (prev)
+		prev->next = block;
+	else
+		arena->bins[class] = block;
+
+	arena->bin_map[class / 64] |= (uint64_t)1 << (class % 64);
+}
+
+void remove_from_bin(struct arena *arena, struct block_meta *block)
+{
+	count_free_blk(arena, block, -1);
+
+	if (block->size >= TREE_MIN_SIZE) {
+		arena->free_tree = tree_remove(arena->free_tree, block);
+		block->prev = NULL;
+		block->next = NULL;
+		goto out;
+	}
+
+	size_t class = get_size_class(block->size);
+
+	if (block->prev)
+		block->prev->next = block->next;
+	else
+		arena->bins[class] = block->next;
+
+	if (block->next)
+		block->next->prev = block->prev;
+
+	if (!arena->bins[class])
+		arena->bin_map[class / 64] &= ~((uint64_t)1 << (class % 64));
+
+	block->prev = NULL;
+	block->next = NULL;
+
+out:
+	// Only taking out the biggest block needs a search, through the right spine of the tree or one bin
+	if (block->size == arena->largest_free)
+		ARENA_STAT_SET(arena->largest_free, find_largest_free(arena));
+}
+
+struct block_meta *find_best_in_bins(struct arena *arena, size_t needed_size)
+{
+	// Every block of the tree is bigger than the ones in the bins
+	if (needed_size >= TREE_MIN_SIZE)
+		return tree_best_fit(arena->free_tree, needed_size);
+
+	size_t class = get_size_class(needed_size);
+
+	// The bin of the requested size may hold smaller blocks of the same range
+	for (struct block_meta *current = arena->bins[class]; current; current = current->next) {
+		if (current->size >= needed_size)
+			return current;
+	}
+
+	// Any block of a bigger class fits, the head of the first non-empty one is the best
+	for (size_t word = (class + 1) / 64; word < BIN_MAP_WORDS; word++) {
+		uint64_t map = arena->bin_map[word];
+
+		if (word == (class + 1) / 64)
+			map &= ~(uint64_t)0 << ((class + 1) % 64);
+
+		if (map)
+			return arena->bins[word * 64 + __builtin_ctzll(map)];
+	}
+
+	return tree_best_fit(arena->free_tree, needed_size);
+}
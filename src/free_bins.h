@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "block_meta.h"
+#include "os_utils.h"
+#include "free_tree.h"
+
+// Exact bins for every aligned size up to SMALL_BIN_LIMIT
+#define SMALL_BIN_LIMIT 1024
+#define NUM_SMALL_BINS (SMALL_BIN_LIMIT / ALIGNMENT)
+
+// Ranged bins: BINS_PER_POW2 bins for every power of two up to TREE_MIN_SIZE
+#define BINS_PER_POW2 4
+#define NUM_RANGED_BINS (2 * BINS_PER_POW2)
+
+// The arenas keep bigger blocks in their tree, the compact heap in the last bin
+#define NUM_BINS (NUM_SMALL_BINS + NUM_RANGED_BINS + 1)
+
+#define BIN_MAP_WORDS ((NUM_BINS + 63) / 64)
+
+struct arena;
+
+size_t get_size_class(size_t size);
+
+void add_in_bin(struct arena *arena, struct block_meta *block);
+
+void remove_from_bin(struct arena *arena, struct block_meta *block);
+
+struct block_meta *find_best_in_bins(struct arena *arena, size_t needed_size);
@@ -0,0 +1,152 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "free_tree.h"
+
+static int level(struct block_meta *node)
+{
+	return node ? node->owner : 0;
+}
+
+static int tree_less(struct block_meta *a, struct block_meta *b)
+{
+	return a->size < b->size || (a->size == b->size && a < b);
+}
+
+// Remove a left horizontal link
+static struct block_meta *skew(struct block_meta *node)
+{
+	if (!node || !node->prev || level(node->prev) != level(node))
+		return node;
+
+	struct block_meta *left = node->prev;
+
+	node->prev = left->next;
+	left->next = node;
+
+	return left;
+}
+
+// Remove two consecutive right horizontal links
+static struct block_meta *split(struct block_meta *node)
+{
+	if (!node || !node->next || level(node->next->next) != level(node))
+		return node;
+
+	struct block_meta *right = node->next;
+
+	node->next = right->prev;
+	right->prev = node;
+	right->owner++;
+
+	return right;
+}
+
+struct block_meta *tree_insert(struct block_meta *root, struct block_meta *block)
+{
+	if (!root) {
+		block->prev = NULL;
+		block->next = NULL;
+		block->owner = 1;
+		return block;
+	}
+
+	if (tree_less(block, root))
+		root->prev = tree_insert(root->prev, block);
+	else
+		root->next = tree_insert(root->next, block);
+
+	return split(skew(root));
+}
+
+// Put 'node' in the place of 'old', the nodes are the blocks so they cannot be copied
+static struct block_meta *replace_node(struct block_meta *old, struct block_meta *node)
+{
+	node->prev = old->prev;
+	node->next = old->next;
+	node->owner = old->owner;
+
+	return node;
+}
+
+struct block_meta *tree_remove(struct block_meta *root, struct block_meta *block)
+{
+	if (!root)
+		return NULL;
+
+	if (tree_less(block, root)) {
+		root->prev = tree_remove(root->prev, block);
+	} else if (tree_less(root, block)) {
+		root->next = tree_remove(root->next, block);
+	} else if (!root->prev && !root->next) {
+		return NULL;
+	} else if (!root->prev) {
+		struct block_meta *successor = root->next;
+
+		while (successor->prev)
+			successor = successor->prev;
+
+		root->next = tree_remove(root->next, successor);
+		root = replace_node(root, successor);
+	} else {
+		struct block_meta *predecessor = root->prev;
+
+		while (predecessor->next)
+			predecessor = predecessor->next;
+
+		root->prev = tree_remove(root->prev, predecessor);
+		root = replace_node(root, predecessor);
+	}
+
+	// Lower the level of the node if one of its children got too low
+	int should_be = (level(root->prev) < level(root->next) ? level(root->prev) : level(root->next)) + 1;
+
+	if (should_be < root->owner) {
+		root->owner = should_be;
+		if (root->next && should_be < root->next->owner)
+			root->next->owner = should_be;
+	}
+
+	root = skew(root);
+	root->next = skew(root->next);
+	if (root->next)
+		root->next->next = skew(root->next->next);
+
+	root = split(root);
+	root->next = split(root->next);
+
+	return root;
+}
+
+struct block_meta *tree_best_fit(struct block_meta *root, size_t size)
+{
+	struct block_meta *best = NULL;
+
+	// The smallest block that fits, the lowest one if several have the same size
+	while (root) {
+		if (root->size >= size) {
+			best = root;
+			root = root->prev;
+		} else {
+			root = root->next;
+		}
+	}
+
+	return best;
+}
+
+struct block_meta *tree_max(struct block_meta *root)
+{
+	while (root && root->next)
+		root = root->next;
+
+	return root;
+}
+
+size_t tree_for_each(struct block_meta *root, size_t (*fn)(struct block_meta *block))
+{
+	if (!root)
+		return 0;
+
+	// The callback must not change the size of the blocks
+	return tree_for_each(root->prev, fn) + fn(root) + tree_for_each(root->next, fn);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include "block_meta.h"
+#include "os_utils.h"
+
+// Free blocks of at least TREE_MIN_SIZE bytes are indexed by the tree instead of the bins
+#define TREE_MIN_SIZE 4096
+
+/*
+ * AA tree of free blocks, ordered by size, then by address. The links of a
+ * free block are reused: 'prev' is the left child, 'next' the right one and
+ * 'owner' the level of the node, so the payload is never touched.
+ */
+struct block_meta *tree_insert(struct block_meta *root, struct block_meta *block);
+
+struct block_meta *tree_remove(struct block_meta *root, struct block_meta *block);
+
+struct block_meta *tree_best_fit(struct block_meta *root, size_t size);
+
+struct block_meta *tree_max(struct block_meta *root);
+
+size_t tree_for_each(struct block_meta *root, size_t (*fn)(struct block_meta *block));
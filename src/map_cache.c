@@ -0,0 +1,190 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <time.h>
+#include <unistd.h>
+
+#include "map_cache.h"
+#include "alloc_helpers.h"
+
+extern size_t blk_meta_size;
+
+extern size_t map_cache_size;
+
+static struct map_cache map_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	// The coarse clock is read from the vDSO, without a system call
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t *cached_at(struct block_meta *block)
+{
+	return (uint64_t *)get_addr_from_blk(block, blk_meta_size);
+}
+
+static void unlink_region(struct block_meta *block)
+{
+	if (block->prev)
+		block->prev->next = block->next;
+	else
+		map_cache.head = block->next;
+
+	if (block->next)
+		block->next->prev = block->prev;
+	else
+		map_cache.tail = block->prev;
+
+	map_cache.total -= get_mapping_size(block);
+}
+
+// Take out the oldest regions until the cache fits 'budget' and holds nothing too old
+static struct block_meta *evict_regions(size_t budget, uint64_t now)
+{
+	struct block_meta *evicted = NULL;
+
+	while (map_cache.tail && (map_cache.total > budget ||
+							  now - *cached_at(map_cache.tail) > MAP_CACHE_MAX_AGE_MS)) {
+		struct block_meta *block = map_cache.tail;
+
+		unlink_region(block);
+		block->next = evicted;
+		evicted = block;
+	}
+
+	return evicted;
+}
+
+// The regions are unmapped after the lock is dropped
+static size_t unmap_regions(struct block_meta *list)
+{
+	size_t released = 0;
+
+	while (list) {
+		struct block_meta *next = list->next;
+		size_t size = get_mapping_size(list);
+
+		DIE(unmap_blk(list) == -1, "Error at munmap in map cache\n");
+		released += size;
+		list = next;
+	}
+
+	return released;
+}
+
+// A plain mapping is only as long as it was asked to be, but the kernel maps it on whole pages
+static size_t region_length(struct block_meta *block)
+{
+	size_t page_size = getpagesize();
+
+	return (get_mapping_size(block) + page_size - 1) & ~(page_size - 1);
+}
+
+// Bytes from the payload of a cached block to the end of its last page
+static size_t region_room(struct block_meta *block)
+{
+	size_t offset = (uintptr_t)block & ((uintptr_t)getpagesize() - 1);
+
+	return region_length(block) - offset - blk_meta_size;
+}
+
+struct block_meta *map_cache_get(size_t blk_size)
+{
+	size_t budget = __atomic_load_n(&map_cache_size, __ATOMIC_RELAXED);
+	size_t page_size = getpagesize();
+	size_t length = (blk_size + blk_meta_size + page_size - 1) & ~(page_size - 1);
+	struct block_meta *best = NULL;
+	size_t best_length = 0;
+
+	if (!budget)
+		return NULL;
+
+	pthread_mutex_lock(&map_cache.lock);
+
+	struct block_meta *evicted = evict_regions(budget, now_ms());
+
+	// The shortest mapping that fits, as long as at most half of it would go unused
+	for (struct block_meta *current = map_cache.head; current; current = current->next) {
+		size_t current_length = region_length(current);
+
+		if (current_length >= length && current_length / 2 <= length && region_room(current) >= blk_size &&
+			(!best || current_length < best_length)) {
+			best = current;
+			best_length = current_length;
+		}
+	}
+
+	if (best)
+		unlink_region(best);
+
+	pthread_mutex_unlock(&map_cache.lock);
+
+	unmap_regions(evicted);
+
+	if (!best)
+		return NULL;
+
+	// The block covers the rest of its mapping, and stays huge if it was
+	best->size = region_room(best);
+	best->next = NULL;
+	best->prev = NULL;
+
+	return best;
+}
+
+int map_cache_put(struct block_meta *block)
+{
+	size_t budget = __atomic_load_n(&map_cache_size, __ATOMIC_RELAXED);
+	uint64_t now = now_ms();
+
+	if (get_mapping_size(block) > budget)
+		return 0;
+
+	*cached_at(block) = now;
+
+	pthread_mutex_lock(&map_cache.lock);
+
+	block->prev = NULL;
+	block->next = map_cache.head;
+
+	if (block->next)
+		block->next->prev = block;
+	else
+		map_cache.tail = block;
+
+	map_cache.head = block;
+	map_cache.total += get_mapping_size(block);
+
+	struct block_meta *evicted = evict_regions(budget, now);
+
+	pthread_mutex_unlock(&map_cache.lock);
+
+	unmap_regions(evicted);
+
+	return 1;
+}
+
+size_t map_cache_flush(void)
+{
+	pthread_mutex_lock(&map_cache.lock);
+
+	struct block_meta *evicted = evict_regions(0, now_ms());
+
+	pthread_mutex_unlock(&map_cache.lock);
+
+	return unmap_regions(evicted);
+}
+
+void lock_map_cache(void)
+{
+	pthread_mutex_lock(&map_cache.lock);
+}
+
+void unlock_map_cache(void)
+{
+	pthread_mutex_unlock(&map_cache.lock);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "block_meta.h"
+#include "os_utils.h"
+
+// Cached regions that were not reused for this long are unmapped
+#define MAP_CACHE_MAX_AGE_MS 1000
+
+/*
+ * Mapped blocks that were freed, kept mapped to serve the next large
+ * allocations without mmap() and without faulting their pages in again.
+ * The regions are linked through their header, the most recent first, and
+ * keep the time they were freed in the first word of their payload.
+ */
+struct map_cache {
+	pthread_mutex_t lock;
+
+	struct block_meta *head;
+	struct block_meta *tail;
+
+	// Bytes mapped by all the cached regions
+	size_t total;
+};
+
+struct block_meta *map_cache_get(size_t blk_size);
+
+int map_cache_put(struct block_meta *block);
+
+size_t map_cache_flush(void);
+
+void lock_map_cache(void);
+
+void unlock_map_cache(void);
@@ -1,7 +1,21 @@
 #pragma once
 
+#include <stdint.h>
+
+// A drop-in malloc() must suit any type, long double and SSE vectors need 16 bytes
+#ifdef OSMEM_PRELOAD
+#define ALIGNMENT 16
+#else
 #define ALIGNMENT 8
+#endif
+
 #define MMAP_THRESHOLD (128*1024)
 
+// Bigger requests are refused, so a size never wraps once its header and alignment are added
+#define MAX_ALLOC_SIZE ((size_t)PTRDIFF_MAX)
+
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
 #define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1))
+#define HUGE_ALIGN(size) (((size) + (HUGE_PAGE_SIZE - 1)) & ~(HUGE_PAGE_SIZE - 1))
 #define BLOCK_SIZE (ALIGN(sizeof(struct block_meta)))
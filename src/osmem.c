@@ -6,94 +6,618 @@
 #include "block_meta.h"
 #include "alloc_helpers.h"
 #include "block_meta_list.h"
-
-struct block_meta *head;
-struct block_meta *tail;
-
-void *heap_end;
+#include "thread_cache.h"
+#include "percpu_cache.h"
+#include "arena.h"
+#include "slab.h"
+#include "compact_heap.h"
+#include "free_tree.h"
+#include "map_cache.h"
+#include "trace.h"
+#include "profile.h"
+
+// List of the mapped blocks, the heap blocks are only linked in the bins of their arena
+struct block_meta *mapped_list;
+
+// The brk heap, with its bins and its own lock
+struct arena main_arena = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
 size_t blk_meta_size = BLOCK_SIZE;
 
 int first_brk_alloc;
 
+// Serve small blocks from per-CPU caches and arenas instead of the brk heap
+int percpu_arenas;
+
+// Serve tiny objects from slabs, without a header
+int use_slabs;
+
+// Give small heap blocks an 8-byte header instead of a struct block_meta
+int compact_headers;
+
+// Resize mapped blocks with mremap() instead of copying them
+int use_mremap;
+
+// Trim the heap when its free tail reaches this size, 0 to only trim on request
+size_t trim_threshold;
+
+// Purge the pages of free blocks of at least this size, 0 to only purge on request
+size_t purge_threshold;
+
+// Keep up to this many bytes of freed mapped blocks mapped for reuse, 0 to unmap them at once
+size_t map_cache_size;
+
+// Requests of at least this size, with their header, are mapped
+size_t mmap_threshold = MMAP_THRESHOLD;
+
+// Raise the mmap threshold up to this size when mapped blocks are freed, 0 to keep it fixed
+size_t mmap_threshold_max;
+
+// Back big mapped blocks and the heaps with huge pages, OSMEM_HUGE_PAGES_THP or OSMEM_HUGE_PAGES_HUGETLB
+int huge_pages;
+
+// Bytes of the mappings and heaps that are backed by huge pages, or were asked to be
+size_t huge_page_bytes;
+
+// Make os_free_sized() check the size it is given against the block
+int check_free_size;
+
+// Mapped blocks in the mapped list and their payload, changed under the heap lock
+size_t mapped_count;
+size_t mapped_bytes;
+
+// Record the allocation calls to the trace file named by OSMEM_TRACE
+int tracing;
+
+// Sample an allocation every this many bytes on average for the heap profile, 0 to stop sampling
+size_t profile_sample;
+
+// Sampled blocks that are still live, frees only look for theirs while there are some
+size_t profiled_blocks;
+
+// Protects the mapped list and the state shared by the arenas
+pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int os_mallopt(int param, int value)
+{
+	switch (param) {
+	case OSMEM_OPT_PERCPU_ARENAS:
+		// Blocks already handed out keep going back to their own arena
+		if (value && init_cpu_arenas())
+			return 0;
+
+		// Nothing would take the cached blocks out again, they go back to their arenas at once
+		if (__atomic_exchange_n(&percpu_arenas, !!value, __ATOMIC_RELAXED) && !value)
+			percpu_drain();
+		return 1;
+
+	case OSMEM_OPT_SLABS:
+		// Slab objects stay valid after the slabs are turned off
+		if (value && init_slabs())
+			return 0;
+
+		__atomic_store_n(&use_slabs, !!value, __ATOMIC_RELAXED);
+		return 1;
+
+	case OSMEM_OPT_COMPACT_HEADERS:
+#ifdef OSMEM_PRELOAD
+		// An 8 byte header cannot keep the payload on the 16 byte alignment that malloc() promises
+		if (value)
+			return 0;
+#endif
+		// The compact heap has its own address range, so both layouts can coexist
+		if (value && init_compact_heap())
+			return 0;
+
+		__atomic_store_n(&compact_headers, !!value, __ATOMIC_RELAXED);
+		return 1;
+
+	case OSMEM_OPT_MREMAP:
+		__atomic_store_n(&use_mremap, !!value, __ATOMIC_RELAXED);
+		return 1;
+
+	case OSMEM_OPT_TRIM_THRESHOLD:
+		if (value < 0)
+			return 0;
+
+		__atomic_store_n(&trim_threshold, value, __ATOMIC_RELAXED);
+		return 1;
+
+	case OSMEM_OPT_PURGE_THRESHOLD:
+		if (value < 0)
+			return 0;
+
+		__atomic_store_n(&purge_threshold, value, __ATOMIC_RELAXED);
+		return 1;
+
+	case OSMEM_OPT_MAP_CACHE:
+		if (value < 0)
+			return 0;
+
+		if (value)
+			register_fork_handlers();
+
+		// Regions over the new budget go back at once
+		__atomic_store_n(&map_cache_size, value, __ATOMIC_RELAXED);
+		if (!value)
+			map_cache_flush();
+		return 1;
+
+	case OSMEM_OPT_MMAP_THRESHOLD_MAX:
+		if (value < 0)
+			return 0;
+
+		__atomic_store_n(&mmap_threshold_max, value, __ATOMIC_RELAXED);
+		if (!value)
+			__atomic_store_n(&mmap_threshold, MMAP_THRESHOLD, __ATOMIC_RELAXED);
+		return 1;
+
+	case OSMEM_OPT_HUGE_PAGES:
+		if (value < 0 || value > OSMEM_HUGE_PAGES_HUGETLB)
+			return 0;
+
+		// Memory that was already handed out keeps its pages
+		__atomic_store_n(&huge_pages, value, __ATOMIC_RELAXED);
+		return 1;
+
+	case OSMEM_OPT_CHECK_FREE_SIZE:
+		__atomic_store_n(&check_free_size, !!value, __ATOMIC_RELAXED);
+		return 1;
+
+	case OSMEM_OPT_PROFILE_SAMPLE:
+		if (value < 0)
+			return 0;
+
+		// Blocks sampled before are still tracked until they are freed
+		if (value && init_profiler())
+			return 0;
+
+		__atomic_store_n(&profile_sample, value, __ATOMIC_RELAXED);
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+// Standard I/O may allocate, so messages are formatted on the stack and written directly
+static void report(const char *format, ...)
+{
+	char buf[256];
+	va_list va;
+
+	va_start(va, format);
+	int len = vsnprintf(buf, sizeof(buf), format, va);
+
+	va_end(va);
+
+	if (len > (int)sizeof(buf) - 1)
+		len = sizeof(buf) - 1;
+
+	if (write(STDERR_FILENO, buf, len) < 0)
+		return;
+}
+
+static void __attribute__((constructor)) read_env_options(void)
+{
+	char *value = getenv("OSMEM_PERCPU_ARENAS");
+
+	if (value)
+		os_mallopt(OSMEM_OPT_PERCPU_ARENAS, atoi(value));
+
+	value = getenv("OSMEM_SLABS");
+	if (value)
+		os_mallopt(OSMEM_OPT_SLABS, atoi(value));
+
+	value = getenv("OSMEM_COMPACT_HEADERS");
+	if (value)
+		os_mallopt(OSMEM_OPT_COMPACT_HEADERS, atoi(value));
+
+	value = getenv("OSMEM_MREMAP");
+	if (value)
+		os_mallopt(OSMEM_OPT_MREMAP, atoi(value));
+
+	value = getenv("OSMEM_TRIM_THRESHOLD");
+	if (value)
+		os_mallopt(OSMEM_OPT_TRIM_THRESHOLD, atoi(value));
+
+	value = getenv("OSMEM_PURGE_THRESHOLD");
+	if (value)
+		os_mallopt(OSMEM_OPT_PURGE_THRESHOLD, atoi(value));
+
+	value = getenv("OSMEM_MAP_CACHE");
+	if (value)
+		os_mallopt(OSMEM_OPT_MAP_CACHE, atoi(value));
+
+	value = getenv("OSMEM_MMAP_THRESHOLD_MAX");
+	if (value)
+		os_mallopt(OSMEM_OPT_MMAP_THRESHOLD_MAX, atoi(value));
+
+	value = getenv("OSMEM_HUGE_PAGES");
+	if (value)
+		os_mallopt(OSMEM_OPT_HUGE_PAGES, atoi(value));
+
+	value = getenv("OSMEM_CHECK_FREE_SIZE");
+	if (value)
+		os_mallopt(OSMEM_OPT_CHECK_FREE_SIZE, atoi(value));
+
+	value = getenv("OSMEM_TRACE");
+	if (value && trace_start(value))
+		report("osmem: cannot write the trace to %s\n", value);
+
+	value = getenv("OSMEM_PROFILE_SAMPLE");
+	if (value)
+		os_mallopt(OSMEM_OPT_PROFILE_SAMPLE, atoi(value));
+
+	// Write the heap profile when the program exits, sampling at the default interval unless told otherwise
+	value = getenv("OSMEM_PROFILE");
+	if (value) {
+		if (!__atomic_load_n(&profile_sample, __ATOMIC_RELAXED))
+			os_mallopt(OSMEM_OPT_PROFILE_SAMPLE, PROFILE_DEFAULT_SAMPLE);
+		profile_dump_at_exit(value);
+	}
+}
+
+static struct block_meta *alloc_small_blk(size_t blk_size, size_t *dirty)
+{
+	struct block_meta *new_block = NULL;
+
+	if (__atomic_load_n(&percpu_arenas, __ATOMIC_RELAXED)) {
+		// Pop a block cached by this CPU, without locking
+		new_block = percpu_get(blk_size);
+		if (new_block)
+			goto cached;
+
+		// Without rseq, lock the arena of the CPU we are running on
+		struct arena *arena = get_current_arena();
+
+		if (arena != &main_arena) {
+			lock_arena(arena);
+			new_block = alloc_brk_blk(arena, blk_size, dirty);
+			unlock_arena(arena);
+		}
+	} else {
+		// Reuse a block cached by this thread, without locking
+		new_block = tcache_get(blk_size);
+		if (new_block)
+			goto cached;
+	}
+
+	// Handle small block allocations on the shared heap
+	if (!new_block) {
+		lock_arena(&main_arena);
+		new_block = alloc_brk_blk(&main_arena, blk_size, dirty);
+		unlock_arena(&main_arena);
+	}
+
+	return new_block;
+
+cached:
+	// Cached blocks were handed out before
+	*dirty = new_block->size;
+	return new_block;
+}
+
 void *os_alloc_helper(size_t blk_size, size_t threshold, int zero)
 {
 	// Return NULL for a request of zero size
 	if (blk_size == 0)
 		return NULL;
 
-	// Determine if the requested size exceeds the threshold
-	int isLargeBlock = (blk_size + blk_meta_size) >= threshold;
-
 	// Allocate memory based on block size
 	void *allocated_mem = NULL;
 
-	if (isLargeBlock) {
-		// Allocate using mmap for large blocks
-		allocated_mem = mmap_alloc(blk_size);
+	// Tiny objects come from slabs and carry no header
+	if (blk_size <= SLAB_MAX_SIZE && __atomic_load_n(&use_slabs, __ATOMIC_RELAXED)) {
+		// Cached slots may hold old data
+		allocated_mem = tcache_slab_get(blk_size);
+		if (allocated_mem) {
+			if (zero)
+				memset(allocated_mem, 0, blk_size);
+			return allocated_mem;
+		}
 
-		// Optionally zero out the memory for calloc
-		if (zero && allocated_mem)
-			memset(allocated_mem, 0, blk_size);
+		allocated_mem = slab_alloc(blk_size, zero);
+		if (allocated_mem)
+			return allocated_mem;
+	}
 
-	} else {
-		// Handle small block allocations
-		if (first_brk_alloc == 0) {
-			allocated_mem = first_heap_alloc(MMAP_THRESHOLD);
-			if (zero && allocated_mem)
-				memset(allocated_mem, 0, blk_size);
+	// Determine if the requested size exceeds the threshold
+	int isLargeBlock = (blk_size + blk_meta_size) >= threshold;
+
+	if (isLargeBlock) {
+		// Allocate using mmap for large blocks, fresh mappings are already zero
+		allocated_mem = mmap_alloc(blk_size, zero);
 
-		} else {
-			// Search for a suitable free block
-			struct block_meta *new_block = find_block_with_size(head, blk_size, blk_meta_size);
+	} else {
+		// Small blocks only pay for a size word in the compact heap
+		if (__atomic_load_n(&compact_headers, __ATOMIC_RELAXED)) {
+			allocated_mem = compact_alloc(blk_size, zero);
+			if (allocated_mem)
+				return allocated_mem;
+		}
 
-			// Allocate a new block if no suitable free block is found
-			if (!new_block)
-				new_block = new_heap(blk_size);
+		size_t dirty;
+		struct block_meta *new_block = alloc_small_blk(blk_size, &dirty);
 
+		if (new_block) {
 			allocated_mem = get_addr_from_blk(new_block, blk_meta_size);
 
-			// Zero out memory for calloc
-			if (zero && allocated_mem)
-				memset(allocated_mem, 0, blk_size);
+			// Zero out for calloc only what a previous block may have written
+			if (zero)
+				memset(allocated_mem, 0, dirty < blk_size ? dirty : blk_size);
 		}
 	}
 
+	// Neither the heap nor a mapping could grow
+	if (!allocated_mem)
+		errno = ENOMEM;
+
 	return allocated_mem;
 }
 
-void *os_malloc(size_t size)
+// Tracing and profiling see the calls of the user, each costs a single load while it is off
+static void *hook_alloc(uint32_t op, void *ptr, size_t size, uintptr_t arg)
+{
+	if (__atomic_load_n(&tracing, __ATOMIC_RELAXED))
+		trace_event(op, ptr, size, arg);
+
+	if (ptr && __atomic_load_n(&profile_sample, __ATOMIC_RELAXED))
+		profile_alloc(ptr, size);
+
+	return ptr;
+}
+
+// Called before the free, the block may be handed out again as soon as it is freed
+static void hook_free(void *ptr)
+{
+	if (__atomic_load_n(&tracing, __ATOMIC_RELAXED))
+		trace_event(TRACE_FREE, ptr, 0, 0);
+
+	if (__atomic_load_n(&profiled_blocks, __ATOMIC_RELAXED))
+		profile_free(ptr);
+}
+
+// The os_* functions call the helpers between them, so that only the calls of the user are hooked
+static void *malloc_helper(size_t size)
 {
 	int calloc = 0;
 
 	size_t alginment = ALIGN(size);
 
-	return os_alloc_helper(alginment, MMAP_THRESHOLD, calloc);
+	return os_alloc_helper(alginment, __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED), calloc);
 }
 
-void os_free(void *ptr)
+// A size no block can have fails like an allocation the system has no memory for
+static int too_big(size_t size)
+{
+	if (size <= MAX_ALLOC_SIZE)
+		return 0;
+
+	errno = ENOMEM;
+	return 1;
+}
+
+void *os_malloc(size_t size)
+{
+	if (too_big(size))
+		return NULL;
+
+	return hook_alloc(TRACE_MALLOC, malloc_helper(size), size, 0);
+}
+
+// A mapped block that gets freed was short-lived, serve the next ones of its size from the heap
+static void raise_mmap_threshold(struct block_meta *block)
+{
+	size_t size = block->size + blk_meta_size;
+
+	if (size < __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) ||
+		size >= __atomic_load_n(&mmap_threshold_max, __ATOMIC_RELAXED))
+		return;
+
+	// Sizes are aligned, so the same request now stays below the threshold
+	__atomic_store_n(&mmap_threshold, size + ALIGNMENT, __ATOMIC_RELAXED);
+}
+
+static void *memalign_helper(size_t alignment, size_t size)
+{
+	// The alignment must be a power of two
+	if (!alignment || (alignment & (alignment - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	// Every block is already aligned on ALIGNMENT
+	if (alignment <= ALIGNMENT)
+		return malloc_helper(size);
+
+	if (size == 0)
+		return NULL;
+
+	size_t blk_size = ALIGN(size);
+
+	// Room for the aligned block and for a free block made of the slack before it
+	size_t padded_size = blk_size + alignment + blk_meta_size;
+
+	if (padded_size + blk_meta_size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+		void *ptr = mmap_align(blk_size, alignment);
+
+		if (!ptr)
+			errno = ENOMEM;
+		return ptr;
+	}
+
+	size_t dirty;
+	struct block_meta *block = alloc_small_blk(padded_size, &dirty);
+
+	if (!block) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	struct arena *arena = get_blk_arena(block);
+
+	lock_arena(arena);
+	block = align_brk_blk(arena, block, alignment, blk_size);
+	unlock_arena(arena);
+
+	return get_addr_from_blk(block, blk_meta_size);
+}
+
+void *os_memalign(size_t alignment, size_t size)
+{
+	if (too_big(size) || too_big(alignment))
+		return NULL;
+
+	return hook_alloc(TRACE_MEMALIGN, memalign_helper(alignment, size), size, alignment);
+}
+
+void *os_aligned_alloc(size_t alignment, size_t size)
+{
+	return os_memalign(alignment, size);
+}
+
+int os_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	// The alignment must be a power of two and a multiple of the size of a pointer
+	if (!alignment || alignment % sizeof(void *) || (alignment & (alignment - 1)))
+		return EINVAL;
+
+	if (size == 0) {
+		*memptr = NULL;
+		return 0;
+	}
+
+	if (size > MAX_ALLOC_SIZE || alignment > MAX_ALLOC_SIZE)
+		return ENOMEM;
+
+	// The error is returned, errno is left as the caller had it
+	int saved_errno = errno;
+	void *ptr = os_memalign(alignment, size);
+
+	errno = saved_errno;
+
+	if (!ptr)
+		return ENOMEM;
+
+	*memptr = ptr;
+	return 0;
+}
+
+size_t os_malloc_batch(size_t size, size_t count, void **ptrs)
+{
+	size_t blk_size = ALIGN(size);
+	size_t done = 0;
+
+	if (blk_size == 0 || too_big(size))
+		return 0;
+
+	// Only heap blocks are carved together, the other kinds are allocated one by one
+	if (blk_size + blk_meta_size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) ||
+		(blk_size <= SLAB_MAX_SIZE && __atomic_load_n(&use_slabs, __ATOMIC_RELAXED)) ||
+		__atomic_load_n(&compact_headers, __ATOMIC_RELAXED)) {
+		for (; done < count; done++) {
+			ptrs[done] = malloc_helper(size);
+			if (!ptrs[done])
+				break;
+		}
+
+		goto out;
+	}
+
+	// Keep every region within the size of the preallocated chunk
+	size_t per_region = (MMAP_THRESHOLD - blk_meta_size) / (blk_size + blk_meta_size);
+
+	if (per_region == 0)
+		per_region = 1;
+
+	while (done < count) {
+		size_t batch = count - done < per_region ? count - done : per_region;
+		size_t carved = 0;
+
+		if (__atomic_load_n(&percpu_arenas, __ATOMIC_RELAXED)) {
+			struct arena *arena = get_current_arena();
+
+			if (arena != &main_arena) {
+				lock_arena(arena);
+				carved = alloc_brk_batch(arena, blk_size, batch, ptrs + done);
+				unlock_arena(arena);
+			}
+		}
+
+		if (!carved) {
+			lock_arena(&main_arena);
+			carved = alloc_brk_batch(&main_arena, blk_size, batch, ptrs + done);
+			unlock_arena(&main_arena);
+		}
+
+		if (!carved)
+			break;
+
+		done += carved;
+	}
+
+out:
+	for (size_t i = 0; i < done; i++)
+		hook_alloc(TRACE_MALLOC, ptrs[i], size, 0);
+
+	return done;
+}
+
+// Keep a heap block in the cache of this CPU or thread if there is room
+static int cache_blk(struct block_meta *block, size_t blk_size)
+{
+	if (__atomic_load_n(&percpu_arenas, __ATOMIC_RELAXED))
+		return percpu_put(block, blk_size);
+
+	return tcache_put(block, blk_size);
+}
+
+static void free_helper(void *ptr)
 {
 	// Ignore freeing if the pointer is NULL
 	if (!ptr)
 		return;
 
+	// Slab objects have no metadata block
+	if (is_slab_ptr(ptr)) {
+		if (!tcache_slab_put(ptr))
+			slab_free(ptr);
+		return;
+	}
+
+	if (is_compact_ptr(ptr)) {
+		compact_free(ptr);
+		return;
+	}
+
 	// Retrieve the metadata block for the given memory address
 	struct block_meta *block_to_free = get_block_from_addr(ptr, blk_meta_size);
 
 	// Check the status of the block and perform the appropriate free operation
 	switch (block_to_free->status) {
 	case STATUS_ALLOC:
-		// Mark the block as free if it was previously allocated
-		block_to_free->status = STATUS_FREE;
+		// Keep the block in the cache of this CPU or thread if there is room
+		if (cache_blk(block_to_free, block_to_free->size))
+			break;
+
+		// Mark the block as free, merge it with its free neighbours and make it reusable
+		release_brk_blk(block_to_free);
 		break;
 
 	case STATUS_MAPPED:
 		// Remove the block from the list and unmap it if it was mapped
-		remove_from_list(&head, &tail, block_to_free);
-		if (munmap((void *) block_to_free, block_to_free->size + blk_meta_size) == -1) {
-			fprintf(stderr, "Error during munmap in free\n");
-			exit(EXIT_FAILURE);
-		}
+		lock_heap();
+		remove_mapped_blk(&mapped_list, block_to_free);
+		unlock_heap();
+
+		raise_mmap_threshold(block_to_free);
+
+		// Keep the region mapped for the next large allocation if the cache has room
+		if (map_cache_put(block_to_free))
+			break;
+
+		DIE(unmap_blk(block_to_free) == -1, "Error at munmap in free\n");
 		break;
 
 	default:
@@ -101,61 +625,341 @@ void os_free(void *ptr)
 	}
 }
 
+void os_free(void *ptr)
+{
+	if (ptr)
+		hook_free(ptr);
+
+	free_helper(ptr);
+}
+
+void os_free_sized(void *ptr, size_t size)
+{
+	if (!ptr)
+		return;
+
+	size_t blk_size = ALIGN(size);
+
+	// The size itself is compared, a huge one would wrap once aligned
+	if (__atomic_load_n(&check_free_size, __ATOMIC_RELAXED) && size > os_malloc_usable_size(ptr)) {
+		report("os_free_sized: size %lu does not match the block at 0x%lx\n", (unsigned long)size, (unsigned long)ptr);
+		abort();
+	}
+
+	hook_free(ptr);
+
+	// The address tells a heap block apart, a small one is cached without reading its header
+	if (blk_size && blk_size <= PCPU_MAX_SIZE && !is_slab_ptr(ptr) && !is_compact_ptr(ptr) && is_arena_ptr(ptr) &&
+		cache_blk(get_block_from_addr(ptr, blk_meta_size), blk_size))
+		return;
+
+	free_helper(ptr);
+}
+
+void os_free_batch(void **ptrs, size_t count)
+{
+	struct arena *locked = NULL;
+
+	for (size_t i = 0; i < count; i++) {
+		void *ptr = ptrs[i];
+
+		if (!ptr)
+			continue;
+
+		hook_free(ptr);
+
+		struct block_meta *block = get_block_from_addr(ptr, blk_meta_size);
+
+		// Heap blocks of the same arena are freed under a single lock, without going through the caches
+		if (!is_slab_ptr(ptr) && !is_compact_ptr(ptr) && block->status == STATUS_ALLOC) {
+			struct arena *arena = get_blk_arena(block);
+
+			if (arena != locked) {
+				if (locked)
+					unlock_arena(locked);
+				lock_arena(arena);
+				drain_remote_frees(arena);
+				locked = arena;
+			}
+
+			free_brk_blk(arena, block, blk_meta_size);
+			continue;
+		}
+
+		// The other kinds take locks that come before the arena ones
+		if (locked) {
+			unlock_arena(locked);
+			locked = NULL;
+		}
+
+		free_helper(ptr);
+	}
+
+	if (locked)
+		unlock_arena(locked);
+}
+
 void *os_calloc(size_t nmemb, size_t size)
 {
+	if (size && too_big(nmemb > MAX_ALLOC_SIZE / size ? SIZE_MAX : nmemb * size))
+		return NULL;
+
 	int calloc = 1;
 	size_t total = ALIGN(nmemb * size);
+	size_t threshold = getpagesize();
+
+	// Once the threshold adapts, calloc shares it with malloc and clears reused heap blocks instead
+	if (__atomic_load_n(&mmap_threshold_max, __ATOMIC_RELAXED))
+		threshold = __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
 
-	return os_alloc_helper(total, getpagesize(), calloc);
+	return hook_alloc(TRACE_CALLOC, os_alloc_helper(total, threshold, calloc), nmemb * size, 0);
 }
 
-void *os_realloc(void *ptr, size_t size)
+static void *realloc_helper(void *ptr, size_t size)
 {
 	// Handle NULL pointer case
 	if (!ptr)
-		return os_malloc(size);
+		return malloc_helper(size);
 
 	// Handle case where size is zero
 	if (size == 0) {
-		os_free(ptr);
+		free_helper(ptr);
 		return NULL;
 	}
 
+	// A slab object stays in place as long as it fits in its slot
+	if (is_slab_ptr(ptr)) {
+		size_t slot_size = slab_slot_size(ptr);
+
+		if (size <= slot_size)
+			return ptr;
+
+		void *new_ptr = malloc_helper(size);
+
+		// The old object stays valid when there is no room for the new one
+		if (!new_ptr)
+			return NULL;
+
+		memcpy(new_ptr, ptr, slot_size);
+		free_helper(ptr);
+		return new_ptr;
+	}
+
+	// A compact chunk is resized in place when its neighbours allow it, sizes over the threshold get mapped
+	if (is_compact_ptr(ptr)) {
+		size_t old_size = compact_usable_size(ptr);
+
+		if (ALIGN(size) + blk_meta_size < __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) &&
+			compact_resize(ptr, ALIGN(size)))
+			return ptr;
+
+		void *new_ptr = malloc_helper(size);
+
+		if (!new_ptr)
+			return NULL;
+
+		// A shrinking chunk only keeps what fits in the new block
+		memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+		free_helper(ptr);
+		return new_ptr;
+	}
+
 	struct block_meta *block = get_block_from_addr(ptr, blk_meta_size);
 	size_t new_size = ALIGN(size);
+	size_t threshold = __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
 
 	// Return NULL if the block is already free
 	if (block->status == STATUS_FREE)
 		return NULL;
 
+	// Resize a mapped block that stays mapped without copying it
+	if (block->status == STATUS_MAPPED && new_size + blk_meta_size >= threshold &&
+		__atomic_load_n(&use_mremap, __ATOMIC_RELAXED)) {
+		struct block_meta *moved_block = mremap_blk(block, new_size);
+
+		if (moved_block)
+			return get_addr_from_blk(moved_block, blk_meta_size);
+	}
+
 	// Handle large sizes or mapped blocks
-	if (new_size + blk_meta_size >= MMAP_THRESHOLD || block->status == STATUS_MAPPED) {
-		void *new_block_ptr = os_malloc(new_size);
+	if (new_size + blk_meta_size >= threshold || block->status == STATUS_MAPPED) {
+		void *new_block_ptr = malloc_helper(new_size);
 		size_t copy_size = block->size < new_size ? block->size : new_size;
 
+		if (!new_block_ptr)
+			return NULL;
+
 		memcpy(new_block_ptr, ptr, copy_size);
-		os_free(ptr);
+		free_helper(ptr);
 		return new_block_ptr;
 	}
 
+	struct arena *arena = get_blk_arena(block);
+
+	lock_arena(arena);
+
 	// Handle resizing within the same block
 	if (new_size <= block->size) {
 		if (new_size < block->size)
-			block = split_blk(block, new_size, blk_meta_size);
+			block = split_blk(arena, block, new_size, blk_meta_size);
 
+		unlock_arena(arena);
 		return get_addr_from_blk(block, blk_meta_size);
 	}
 
 	// Try expanding the block in place
-	struct block_meta *expanded_block = expand_realloc(head, block, new_size, blk_meta_size);
+	struct block_meta *expanded_block = expand_realloc(arena, block, new_size, blk_meta_size);
+
+	unlock_arena(arena);
 
 	if (expanded_block)
 		return get_addr_from_blk(expanded_block, blk_meta_size);
 
 	// Allocate a new block and copy data if in-place expansion is not possible
-	void *new_block_ptr = os_malloc(size);
+	void *new_block_ptr = malloc_helper(size);
+
+	if (!new_block_ptr)
+		return NULL;
 
 	memcpy(new_block_ptr, ptr, block->size);
-	os_free(ptr);
+	free_helper(ptr);
 	return new_block_ptr;
 }
+
+void *os_realloc(void *ptr, size_t size)
+{
+	struct profile_sample *sample = NULL;
+
+	// The old block is left as it was, like for any other failed realloc
+	if (too_big(size))
+		return NULL;
+
+	// The old block stops being sampled before another thread can get it
+	if (ptr && __atomic_load_n(&profiled_blocks, __ATOMIC_RELAXED))
+		sample = profile_detach(ptr);
+
+	void *new_ptr = realloc_helper(ptr, size);
+
+	// A failed realloc leaves the old block allocated, and sampled
+	if (sample) {
+		if (!new_ptr && size)
+			profile_attach(sample);
+		else
+			profile_release(sample);
+	}
+
+	// Recorded once it returns, another thread reusing the old block before that is replayed out of order
+	return hook_alloc(TRACE_REALLOC, new_ptr, size, (uintptr_t)ptr);
+}
+
+size_t os_malloc_usable_size(void *ptr)
+{
+	if (!ptr)
+		return 0;
+
+	if (is_slab_ptr(ptr))
+		return slab_slot_size(ptr);
+
+	if (is_compact_ptr(ptr))
+		return compact_usable_size(ptr);
+
+	struct block_meta *block = get_block_from_addr(ptr, blk_meta_size);
+
+	// Includes the leftover that was too small to be split off
+	return block->status == STATUS_FREE ? 0 : block->size;
+}
+
+size_t os_nallocx(size_t size)
+{
+	// No block could be that big
+	if (size == 0 || size > MAX_ALLOC_SIZE)
+		return 0;
+
+	size_t blk_size = ALIGN(size);
+
+	// Follow the same path as os_malloc(), a reused block may still turn out bigger
+	if (blk_size <= SLAB_MAX_SIZE && __atomic_load_n(&use_slabs, __ATOMIC_RELAXED))
+		return (blk_size + SLAB_ALIGNMENT - 1) & ~(SLAB_ALIGNMENT - 1);
+
+	if (blk_size + blk_meta_size >= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED)) {
+		if (blk_size + blk_meta_size >= HUGE_PAGE_SIZE && __atomic_load_n(&huge_pages, __ATOMIC_RELAXED))
+			return HUGE_ALIGN(blk_size + blk_meta_size) - blk_meta_size;
+
+		return blk_size;
+	}
+
+	if (__atomic_load_n(&compact_headers, __ATOMIC_RELAXED) && blk_size < COMPACT_MIN_SIZE)
+		return COMPACT_MIN_SIZE;
+
+	return blk_size;
+}
+
+int os_trim(size_t pad)
+{
+	size_t released = 0;
+
+	for (int i = 0; i < get_arena_count(); i++) {
+		struct arena *arena = get_arena(i);
+
+		lock_arena(arena);
+		drain_remote_frees(arena);
+		released += trim_arena(arena, pad);
+		released += tree_for_each(arena->free_tree, purge_blk);
+		unlock_arena(arena);
+	}
+
+	released += map_cache_flush();
+
+	return released != 0;
+}
+
+size_t os_huge_page_bytes(void)
+{
+	return __atomic_load_n(&huge_page_bytes, __ATOMIC_RELAXED);
+}
+
+int os_profile_dump(const char *path)
+{
+	return profile_dump(path);
+}
+
+void os_malloc_stats(struct osmem_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	// No lock is taken, counters of blocks being split or merged may be a step apart
+	for (int i = 0; i < get_arena_count(); i++) {
+		struct arena *arena = get_arena(i);
+
+		// The blocks of a heap cover it from start to end
+		size_t span = (char *)__atomic_load_n(&arena->heap_end, __ATOMIC_RELAXED) -
+					  (char *)__atomic_load_n(&arena->heap_start, __ATOMIC_RELAXED);
+		size_t blocks = __atomic_load_n(&arena->nr_blocks, __ATOMIC_RELAXED);
+		size_t free_bytes = __atomic_load_n(&arena->free_bytes, __ATOMIC_RELAXED);
+		size_t largest = __atomic_load_n(&arena->largest_free, __ATOMIC_RELAXED);
+
+		stats->heap_size += span;
+		stats->block_count += blocks;
+		stats->free_bytes += free_bytes;
+		if (span > blocks * blk_meta_size + free_bytes)
+			stats->used_bytes += span - blocks * blk_meta_size - free_bytes;
+		if (largest > stats->largest_free_block)
+			stats->largest_free_block = largest;
+
+		for (int class = 0; class < OSMEM_STATS_CLASSES; class++) {
+			stats->class_free_blocks[class] += __atomic_load_n(&arena->class_free_blocks[class], __ATOMIC_RELAXED);
+			stats->class_free_bytes[class] += __atomic_load_n(&arena->class_free_bytes[class], __ATOMIC_RELAXED);
+		}
+	}
+
+	stats->mapped_count = __atomic_load_n(&mapped_count, __ATOMIC_RELAXED);
+	stats->mapped_bytes = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+	stats->block_count += stats->mapped_count;
+	stats->used_bytes += stats->mapped_bytes;
+	stats->heap_size += stats->mapped_bytes + stats->mapped_count * blk_meta_size;
+
+	add_slab_stats(stats);
+	add_compact_stats(stats);
+
+	stats->huge_page_bytes = __atomic_load_n(&huge_page_bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <sys/mman.h>
+
+#include "page_map.h"
+
+/*
+ * Marks the pages that hold the payload of a mapped block, so that a pointer
+ * is told apart from a foreign one without walking the list of mapped blocks.
+ * Marking happens under the heap lock, testing takes no lock at all.
+ */
+static uint64_t *page_map[1UL << PAGE_MAP_ROOT_BITS];
+
+static uint64_t *get_leaf(uintptr_t page, int create)
+{
+	uintptr_t root = page >> PAGE_MAP_LEAF_BITS;
+
+	if (root >= (1UL << PAGE_MAP_ROOT_BITS))
+		return NULL;
+
+	uint64_t *leaf = __atomic_load_n(&page_map[root], __ATOMIC_ACQUIRE);
+
+	if (leaf || !create)
+		return leaf;
+
+	leaf = mmap(NULL, PAGE_MAP_LEAF_WORDS * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	DIE(leaf == MAP_FAILED, "Error at mmap in page map\n");
+
+	// Leaves are never unmapped, so a reader may keep using one it loaded
+	__atomic_store_n(&page_map[root], leaf, __ATOMIC_RELEASE);
+
+	return leaf;
+}
+
+void page_map_set(void *addr)
+{
+	uintptr_t page = (uintptr_t)addr >> PAGE_MAP_SHIFT;
+	uint64_t *leaf = get_leaf(page, 1);
+	size_t bit = page & ((1UL << PAGE_MAP_LEAF_BITS) - 1);
+
+	if (leaf)
+		__atomic_or_fetch(&leaf[bit / 64], (uint64_t)1 << (bit % 64), __ATOMIC_RELAXED);
+}
+
+void page_map_clear(void *addr)
+{
+	uintptr_t page = (uintptr_t)addr >> PAGE_MAP_SHIFT;
+	uint64_t *leaf = get_leaf(page, 0);
+	size_t bit = page & ((1UL << PAGE_MAP_LEAF_BITS) - 1);
+
+	if (leaf)
+		__atomic_and_fetch(&leaf[bit / 64], ~((uint64_t)1 << (bit % 64)), __ATOMIC_RELAXED);
+}
+
+int page_map_test(void *addr)
+{
+	uintptr_t page = (uintptr_t)addr >> PAGE_MAP_SHIFT;
+	uint64_t *leaf = get_leaf(page, 0);
+	size_t bit = page & ((1UL << PAGE_MAP_LEAF_BITS) - 1);
+
+	return leaf && (__atomic_load_n(&leaf[bit / 64], __ATOMIC_RELAXED) >> (bit % 64)) & 1;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "block_meta.h"
+#include "os_utils.h"
+
+// Every 4 KB of the 48 bit address space gets one bit, mappings never share such a page
+#define PAGE_MAP_SHIFT 12
+#define PAGE_MAP_LEAF_BITS 18
+#define PAGE_MAP_ROOT_BITS (48 - PAGE_MAP_SHIFT - PAGE_MAP_LEAF_BITS)
+
+// A leaf holds the bits of 1 GB of address space and is only mapped once a page in it is marked
+#define PAGE_MAP_LEAF_WORDS ((1UL << PAGE_MAP_LEAF_BITS) / 64)
+
+void page_map_set(void *addr);
+
+void page_map_clear(void *addr);
+
+int page_map_test(void *addr);
@@ -0,0 +1,354 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+
+#include "percpu_cache.h"
+#include "arena.h"
+#include "alloc_helpers.h"
+
+/*
+ * The critical sections are written for x86-64, and <sys/rseq.h> comes with
+ * the C libraries that register rseq themselves (glibc 2.35 and later).
+ * Anywhere else nothing is cached per CPU, and every allocation locks the
+ * arena of the CPU it runs on.
+ */
+#if defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#define HAVE_RSEQ 1
+#endif
+#endif
+
+#ifdef HAVE_RSEQ
+
+#include <sys/rseq.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+
+static struct cpu_cache *cpu_caches;
+static int nr_cpu_caches;
+
+// Used when the C library did not register rseq for this thread
+static __thread struct rseq own_rseq __attribute__((tls_model("initial-exec"), aligned(32)));
+
+static __thread struct rseq *thread_rseq __attribute__((tls_model("initial-exec")));
+
+// 0 before the first use, 1 if rseq works for this thread, -1 otherwise
+static __thread int rseq_state __attribute__((tls_model("initial-exec")));
+
+int init_cpu_caches(int count)
+{
+	void *mem = mmap(NULL, count * sizeof(struct cpu_cache), PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (mem == (void *) -1)
+		return -1;
+
+	// The caches can only be drained if the sequences running on a CPU can be restarted, else none is used
+	if (syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0))
+		count = 0;
+
+	nr_cpu_caches = count;
+	__atomic_store_n(&cpu_caches, mem, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static struct rseq *get_rseq(void)
+{
+	if (rseq_state)
+		return rseq_state > 0 ? thread_rseq : NULL;
+
+	rseq_state = -1;
+
+	// Reuse the area registered by the C library, or register our own
+	if (__rseq_size)
+		thread_rseq = (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+	else if (syscall(__NR_rseq, &own_rseq, sizeof(own_rseq), 0, RSEQ_SIG) == 0)
+		thread_rseq = &own_rseq;
+	else
+		return NULL;
+
+	if ((int)thread_rseq->cpu_id < 0)
+		return NULL;
+
+	rseq_state = 1;
+	return thread_rseq;
+}
+
+/*
+ * Pop the top of a per-CPU stack. The sequence is restarted by the kernel if the
+ * thread is preempted, migrated or signaled before the single committing store,
+ * and gives up while the cache is being drained.
+ */
+static int rseq_pop(struct rseq *rs, unsigned int cpu, int *draining, unsigned long *top,
+					struct block_meta **slots, struct block_meta **block)
+{
+	int ret;
+	struct block_meta *item;
+
+	__asm__ __volatile__(
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n\t"
+		"3:\n\t"
+		".long 0x0, 0x0\n\t"
+		".quad 1f, (2f - 1f), 4f\n\t"
+		".popsection\n\t"
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %[rseq_cs]\n\t"
+		"1:\n\t"
+		"cmpl %[cpu], %[cpu_id]\n\t"
+		"jnz 4f\n\t"
+		"cmpl $0, %[draining]\n\t"
+		"jnz 4f\n\t"
+		"movq %[top], %%rcx\n\t"
+		"testq %%rcx, %%rcx\n\t"
+		"jz 5f\n\t"
+		"movq -8(%[slots], %%rcx, 8), %[item]\n\t"
+		"decq %%rcx\n\t"
+		"movq %%rcx, %[top]\n\t"
+		"2:\n\t"
+		"movl $1, %[ret]\n\t"
+		"jmp 6f\n\t"
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long 0x53053053\n\t"
+		"4:\n\t"
+		"movl $-1, %[ret]\n\t"
+		"jmp 6f\n\t"
+		"5:\n\t"
+		"movl $0, %[ret]\n\t"
+		"6:\n\t"
+		: [ret] "=&r" (ret), [item] "=&r" (item), [top] "+m" (*top), [rseq_cs] "=m" (rs->rseq_cs)
+		: [cpu] "r" (cpu), [cpu_id] "m" (rs->cpu_id), [draining] "m" (*draining), [slots] "r" (slots)
+		: "rax", "rcx", "memory", "cc");
+
+	if (ret == RSEQ_DONE)
+		*block = item;
+
+	return ret;
+}
+
+// Push on a per-CPU stack, the slot is written first and published by the commit
+static int rseq_push(struct rseq *rs, unsigned int cpu, int *draining, unsigned long *top,
+					 struct block_meta **slots, struct block_meta *block)
+{
+	int ret;
+
+	__asm__ __volatile__(
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n\t"
+		"3:\n\t"
+		".long 0x0, 0x0\n\t"
+		".quad 1f, (2f - 1f), 4f\n\t"
+		".popsection\n\t"
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %[rseq_cs]\n\t"
+		"1:\n\t"
+		"cmpl %[cpu], %[cpu_id]\n\t"
+		"jnz 4f\n\t"
+		"cmpl $0, %[draining]\n\t"
+		"jnz 4f\n\t"
+		"movq %[top], %%rcx\n\t"
+		"cmpq %[count], %%rcx\n\t"
+		"jae 5f\n\t"
+		"movq %[item], (%[slots], %%rcx, 8)\n\t"
+		"incq %%rcx\n\t"
+		"movq %%rcx, %[top]\n\t"
+		"2:\n\t"
+		"movl $1, %[ret]\n\t"
+		"jmp 6f\n\t"
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long 0x53053053\n\t"
+		"4:\n\t"
+		"movl $-1, %[ret]\n\t"
+		"jmp 6f\n\t"
+		"5:\n\t"
+		"movl $0, %[ret]\n\t"
+		"6:\n\t"
+		: [ret] "=&r" (ret), [top] "+m" (*top), [rseq_cs] "=m" (rs->rseq_cs)
+		: [cpu] "r" (cpu), [cpu_id] "m" (rs->cpu_id), [draining] "m" (*draining), [slots] "r" (slots),
+		  [item] "r" (block), [count] "i" (PCPU_COUNT)
+		: "rax", "rcx", "memory", "cc");
+
+	return ret;
+}
+
+static struct cpu_cache *get_cpu_cache(struct rseq *rs, unsigned int *cpu)
+{
+	*cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED);
+
+	// A CPU without its own cache never shares another one, nor uses its own while it is drained
+	if (*cpu >= (unsigned int)nr_cpu_caches || __atomic_load_n(&cpu_caches[*cpu].draining, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &cpu_caches[*cpu];
+}
+
+static struct block_meta *percpu_refill(unsigned int cpu, size_t blk_size)
+{
+	struct block_meta *blocks[PCPU_BATCH];
+	struct arena *arena = get_cpu_arena(cpu);
+	int count = 0;
+
+	// Take a batch of blocks from the arena of this CPU under a single lock
+	lock_arena(arena);
+	while (count < PCPU_BATCH) {
+		blocks[count] = alloc_brk_blk(arena, blk_size, NULL);
+		if (!blocks[count])
+			break;
+		count++;
+	}
+	unlock_arena(arena);
+
+	if (!count)
+		return NULL;
+
+	// Keep the first block for the caller and cache the others
+	for (int i = 1; i < count; i++) {
+		if (!percpu_put(blocks[i], blocks[i]->size))
+			release_brk_blk(blocks[i]);
+	}
+
+	return blocks[0];
+}
+
+static void percpu_flush(struct rseq *rs, size_t bin, int count)
+{
+	struct block_meta *block;
+
+	// Give up to 'count' blocks of the bin back to the arenas they belong to
+	while (count) {
+		unsigned int cpu;
+		struct cpu_cache *cache = get_cpu_cache(rs, &cpu);
+		int ret = cache ? rseq_pop(rs, cpu, &cache->draining, &cache->top[bin], cache->slots[bin], &block)
+						: RSEQ_NO_ROOM;
+
+		if (ret == RSEQ_NO_ROOM)
+			break;
+
+		if (ret == RSEQ_DONE) {
+			release_brk_blk(block);
+			count--;
+		}
+	}
+}
+
+struct block_meta *percpu_get(size_t blk_size)
+{
+	struct rseq *rs = get_rseq();
+
+	if (blk_size > PCPU_MAX_SIZE || !rs)
+		return NULL;
+
+	size_t bin = blk_size / ALIGNMENT - 1;
+
+	for (;;) {
+		unsigned int cpu;
+		struct block_meta *block;
+		struct cpu_cache *cache = get_cpu_cache(rs, &cpu);
+
+		if (!cache)
+			return NULL;
+
+		int ret = rseq_pop(rs, cpu, &cache->draining, &cache->top[bin], cache->slots[bin], &block);
+
+		if (ret == RSEQ_DONE)
+			return block;
+
+		if (ret == RSEQ_NO_ROOM)
+			return percpu_refill(cpu, blk_size);
+	}
+}
+
+int percpu_put(struct block_meta *block, size_t blk_size)
+{
+	struct rseq *rs = get_rseq();
+
+	if (blk_size > PCPU_MAX_SIZE || !rs)
+		return 0;
+
+	// The header is never touched, a block bigger than its bin is still big enough for it
+	size_t bin = blk_size / ALIGNMENT - 1;
+
+	for (;;) {
+		unsigned int cpu;
+		struct cpu_cache *cache = get_cpu_cache(rs, &cpu);
+
+		if (!cache)
+			return 0;
+
+		// Cached blocks stay allocated, so they are never merged with their neighbours
+		int ret = rseq_push(rs, cpu, &cache->draining, &cache->top[bin], cache->slots[bin], block);
+
+		if (ret == RSEQ_DONE)
+			return 1;
+
+		if (ret == RSEQ_NO_ROOM)
+			percpu_flush(rs, bin, PCPU_BATCH);
+	}
+}
+
+// Stop the cache of a CPU, none of its sequences can commit once this returns 1
+static int stop_cpu_cache(struct cpu_cache *cache, int cpu)
+{
+	// Someone else is draining it already
+	if (__atomic_exchange_n(&cache->draining, 1, __ATOMIC_SEQ_CST))
+		return 0;
+
+	// Restart the sequences running on the CPU, they may have seen the cache before it was stopped
+	if (syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, MEMBARRIER_CMD_FLAG_CPU, cpu))
+		DIE(syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0, 0),
+			"Error at membarrier in percpu drain\n");
+
+	return 1;
+}
+
+void percpu_drain(void)
+{
+	if (!__atomic_load_n(&cpu_caches, __ATOMIC_ACQUIRE))
+		return;
+
+	for (int cpu = 0; cpu < nr_cpu_caches; cpu++) {
+		struct cpu_cache *cache = &cpu_caches[cpu];
+
+		if (!stop_cpu_cache(cache, cpu))
+			continue;
+
+		// Nothing else touches a stopped cache, so it is emptied from whatever CPU this runs on
+		for (size_t bin = 0; bin < PCPU_BINS; bin++) {
+			while (cache->top[bin])
+				release_brk_blk(cache->slots[bin][--cache->top[bin]]);
+		}
+
+		__atomic_store_n(&cache->draining, 0, __ATOMIC_RELEASE);
+	}
+}
+
+#else
+
+int init_cpu_caches(int count)
+{
+	(void)count;
+
+	return 0;
+}
+
+struct block_meta *percpu_get(size_t blk_size)
+{
+	(void)blk_size;
+
+	return NULL;
+}
+
+int percpu_put(struct block_meta *block, size_t blk_size)
+{
+	(void)block;
+	(void)blk_size;
+
+	return 0;
+}
+
+void percpu_drain(void)
+{
+}
+
+#endif
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include "block_meta.h"
+#include "os_utils.h"
+
+// Blocks of up to PCPU_MAX_SIZE bytes are cached, one bin for every aligned size
+#define PCPU_MAX_SIZE 512
+#define PCPU_BINS (PCPU_MAX_SIZE / ALIGNMENT)
+
+// Maximum number of blocks kept in a bin and how many are moved at once
+#define PCPU_COUNT 32
+#define PCPU_BATCH (PCPU_COUNT / 2)
+
+// Results of a restartable sequence
+#define RSEQ_DONE     1
+#define RSEQ_NO_ROOM  0
+#define RSEQ_ABORTED -1
+
+// Stack of free blocks for every bin, only the CPU owning it touches it unless it is being drained
+struct cpu_cache {
+	unsigned long top[PCPU_BINS];
+	struct block_meta *slots[PCPU_BINS][PCPU_COUNT];
+	int draining;
+};
+
+int init_cpu_caches(int count);
+
+struct block_meta *percpu_get(size_t blk_size);
+
+int percpu_put(struct block_meta *block, size_t blk_size);
+
+// Give the blocks cached by every CPU back to their arenas
+void percpu_drain(void);
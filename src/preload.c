@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdint.h>
+
+#include "osmem.h"
+#include "alloc_helpers.h"
+#include "arena.h"
+#include "slab.h"
+#include "compact_heap.h"
+#include "page_map.h"
+
+/*
+ * Standard allocation entry points on top of the os_* ones, built into
+ * libosmem_preload.so to be loaded with LD_PRELOAD. Blocks that were not
+ * handed out by the allocator, like the ones glibc allocated on its own,
+ * are given back to glibc.
+ */
+
+void __libc_free(void *ptr);
+
+void *__libc_realloc(void *ptr, size_t size);
+
+void osmem_die(const char *file, int line, const char *call_description)
+{
+	char buf[256];
+	int err = errno;
+	int len = snprintf(buf, sizeof(buf), "(%s, %d): %s (errno %d)\n", file, line, call_description, err);
+
+	// Standard I/O may allocate, so the message is written directly
+	if (write(STDERR_FILENO, buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf) - 1) < 0)
+		err = errno;
+
+	_exit(err);
+}
+
+// The page of a mapped payload is marked, only then is the header before the pointer known to be readable
+static int is_mapped_ptr(void *ptr)
+{
+	return page_map_test(ptr) && get_block_from_addr(ptr, BLOCK_SIZE)->status == STATUS_MAPPED;
+}
+
+// Only the address is looked at, the memory before a foreign pointer may not be a header
+static int is_own_ptr(void *ptr)
+{
+	return is_slab_ptr(ptr) || is_compact_ptr(ptr) || is_arena_ptr(ptr) || is_mapped_ptr(ptr);
+}
+
+void *malloc(size_t size)
+{
+	// Callers expect a unique pointer for an empty request
+	return os_malloc(size ? size : 1);
+}
+
+void free(void *ptr)
+{
+	if (ptr && !is_own_ptr(ptr)) {
+		__libc_free(ptr);
+		return;
+	}
+
+	os_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (size && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (!nmemb || !size)
+		return os_calloc(1, 1);
+
+	return os_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (ptr && !is_own_ptr(ptr))
+		return __libc_realloc(ptr, size);
+
+	return os_realloc(ptr, size);
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	if (size && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return realloc(ptr, nmemb * size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	return os_memalign(alignment, size ? size : 1);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	return os_aligned_alloc(alignment, size ? size : 1);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	return os_posix_memalign(memptr, alignment, size ? size : 1);
+}
+
+void *valloc(size_t size)
+{
+	return os_memalign(getpagesize(), size ? size : 1);
+}
+
+void *pvalloc(size_t size)
+{
+	size_t page_size = getpagesize();
+
+	return os_memalign(page_size, size ? (size + page_size - 1) & ~(page_size - 1) : page_size);
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+	if (ptr && !is_own_ptr(ptr))
+		return 0;
+
+	return os_malloc_usable_size(ptr);
+}
@@ -0,0 +1,474 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <time.h>
+#include <execinfo.h>
+
+#include "profile.h"
+#include "trace.h"
+#include "alloc_helpers.h"
+
+extern size_t profile_sample;
+
+extern size_t profiled_blocks;
+
+// Protects the tables of samples and stacks
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct profile_sample *sample_buckets[PROFILE_SAMPLE_BUCKETS];
+static struct profile_stack *stack_buckets[PROFILE_STACK_BUCKETS];
+static struct profile_sample *free_samples;
+
+/*
+ * Counting filter of the sampled addresses, a free only takes the lock when
+ * the counter of its address is set. It is changed under the lock and read
+ * without it.
+ */
+static unsigned short sampled_filter[PROFILE_FILTER_SIZE];
+
+// Records are carved from mappings that are never given back
+static char *pool;
+static size_t pool_left;
+
+// Code of the allocator itself, its frames are left out of the stacks
+static uintptr_t lib_start;
+static uintptr_t lib_end;
+
+static const char *exit_path;
+
+// Initial-exec TLS never allocates, even when the library is preloaded
+static __thread size_t bytes_until_sample __attribute__((tls_model("initial-exec")));
+static __thread uint64_t sample_seed __attribute__((tls_model("initial-exec")));
+
+// Set while a sample is taken, the allocations made by backtrace() are not sampled
+static __thread int profile_busy __attribute__((tls_model("initial-exec")));
+
+static pthread_once_t profile_once = PTHREAD_ONCE_INIT;
+
+static size_t hash_ptr(void *ptr, size_t buckets)
+{
+	return ((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL >> 32 & (buckets - 1);
+}
+
+static uint64_t hash_stack(void **pcs, int depth)
+{
+	uint64_t hash = depth;
+
+	for (int i = 0; i < depth; i++)
+		hash = (hash ^ (uintptr_t)pcs[i]) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+// -ln(u) for u in (0, 1], without libm: the exponent plus a short series for the mantissa
+static double neg_log(double u)
+{
+	uint64_t bits;
+	double mantissa;
+
+	memcpy(&bits, &u, sizeof(bits));
+
+	int exponent = (int)((bits >> 52) & 0x7ff) - 1023;
+
+	bits = (bits & ((1ULL << 52) - 1)) | (1023ULL << 52);
+	memcpy(&mantissa, &bits, sizeof(mantissa));
+
+	double z = (mantissa - 1) / (mantissa + 1);
+	double z2 = z * z;
+
+	return -(exponent * 0.6931471805599453 + 2 * z * (1 + z2 / 3 + z2 * z2 / 5 + z2 * z2 * z2 / 7));
+}
+
+// Bytes until the next sample, exponentially distributed so every byte has the same chance to be sampled
+static size_t next_sample_distance(void)
+{
+	size_t mean = __atomic_load_n(&profile_sample, __ATOMIC_RELAXED);
+
+	if (!sample_seed)
+		sample_seed = ((uintptr_t)&sample_seed ^ (uint64_t)time(NULL)) | 1;
+
+	// xorshift64
+	sample_seed ^= sample_seed << 13;
+	sample_seed ^= sample_seed >> 7;
+	sample_seed ^= sample_seed << 17;
+
+	double u = ((sample_seed >> 11) + 1) * (1.0 / (1ULL << 53));
+
+	return (size_t)(neg_log(u) * mean) + 1;
+}
+
+// Must be called with the profile lock held
+static void *pool_alloc(size_t size)
+{
+	if (pool_left < size) {
+		pool = mmap(NULL, MMAP_THRESHOLD, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		DIE(pool == MAP_FAILED, "Error at mmap in profile\n");
+		pool_left = MMAP_THRESHOLD;
+	}
+
+	void *mem = pool;
+
+	pool += ALIGN(size);
+	pool_left -= ALIGN(size);
+
+	return mem;
+}
+
+// Must be called with the profile lock held
+static struct profile_stack *find_stack(void **pcs, int depth)
+{
+	uint64_t hash = hash_stack(pcs, depth);
+	struct profile_stack **bucket = &stack_buckets[hash & (PROFILE_STACK_BUCKETS - 1)];
+
+	for (struct profile_stack *stack = *bucket; stack; stack = stack->next)
+		if (stack->hash == hash && stack->depth == depth && !memcmp(stack->pcs, pcs, depth * sizeof(void *)))
+			return stack;
+
+	struct profile_stack *stack = pool_alloc(sizeof(*stack));
+
+	memset(stack, 0, sizeof(*stack));
+	stack->hash = hash;
+	stack->depth = depth;
+	memcpy(stack->pcs, pcs, depth * sizeof(void *));
+	stack->next = *bucket;
+	*bucket = stack;
+
+	return stack;
+}
+
+static int find_lib_range(struct dl_phdr_info *info, size_t size, void *data)
+{
+	uintptr_t self = (uintptr_t)data;
+	uintptr_t start = UINTPTR_MAX, end = 0;
+
+	(void)size;
+
+	for (int i = 0; i < info->dlpi_phnum; i++) {
+		const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+
+		if (phdr->p_type != PT_LOAD)
+			continue;
+
+		if (info->dlpi_addr + phdr->p_vaddr < start)
+			start = info->dlpi_addr + phdr->p_vaddr;
+		if (info->dlpi_addr + phdr->p_vaddr + phdr->p_memsz > end)
+			end = info->dlpi_addr + phdr->p_vaddr + phdr->p_memsz;
+	}
+
+	if (self < start || self >= end)
+		return 0;
+
+	lib_start = start;
+	lib_end = end;
+
+	return 1;
+}
+
+static void lock_profile(void)
+{
+	pthread_mutex_lock(&profile_lock);
+}
+
+static void unlock_profile(void)
+{
+	pthread_mutex_unlock(&profile_lock);
+}
+
+static void profile_init_once(void)
+{
+	void *pc;
+
+	dl_iterate_phdr(find_lib_range, (void *)profile_alloc);
+
+	// The first backtrace() loads the unwinder, which allocates
+	backtrace(&pc, 1);
+
+	DIE(pthread_atfork(lock_profile, unlock_profile, unlock_profile), "Error at pthread_atfork in profile\n");
+}
+
+int init_profiler(void)
+{
+	pthread_once(&profile_once, profile_init_once);
+
+	return 0;
+}
+
+// Must be called with the profile lock held
+static void link_sample(struct profile_sample *sample)
+{
+	size_t bucket = hash_ptr(sample->ptr, PROFILE_SAMPLE_BUCKETS);
+	size_t slot = hash_ptr(sample->ptr, PROFILE_FILTER_SIZE);
+
+	sample->next = sample_buckets[bucket];
+	sample_buckets[bucket] = sample;
+
+	__atomic_store_n(&sampled_filter[slot], sampled_filter[slot] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&profiled_blocks, profiled_blocks + 1, __ATOMIC_RELAXED);
+}
+
+void profile_alloc(void *ptr, size_t size)
+{
+	void *pcs[PROFILE_MAX_DEPTH + 8];
+	int depth, skip = 0;
+
+	if (size < bytes_until_sample) {
+		bytes_until_sample -= size;
+		return;
+	}
+
+	if (profile_busy)
+		return;
+
+	// A thread starts with a distance of its own, its first allocation is not always sampled
+	if (!sample_seed) {
+		bytes_until_sample = next_sample_distance();
+		if (size < bytes_until_sample) {
+			bytes_until_sample -= size;
+			return;
+		}
+	}
+
+	profile_busy = 1;
+	bytes_until_sample = next_sample_distance();
+
+	// Leave out the frames of the allocator
+	depth = backtrace(pcs, PROFILE_MAX_DEPTH + 8);
+	while (skip < depth && (uintptr_t)pcs[skip] >= lib_start && (uintptr_t)pcs[skip] < lib_end)
+		skip++;
+
+	depth -= skip;
+	if (depth > PROFILE_MAX_DEPTH)
+		depth = PROFILE_MAX_DEPTH;
+
+	lock_profile();
+
+	struct profile_stack *stack = find_stack(pcs + skip, depth);
+	struct profile_sample *sample = free_samples;
+
+	if (sample)
+		free_samples = sample->next;
+	else
+		sample = pool_alloc(sizeof(*sample));
+
+	sample->ptr = ptr;
+	sample->size = size;
+	sample->stack = stack;
+
+	link_sample(sample);
+
+	stack->live_count++;
+	stack->live_bytes += size;
+	stack->alloc_count++;
+	stack->alloc_bytes += size;
+
+	unlock_profile();
+
+	profile_busy = 0;
+}
+
+// The block is no longer looked up, its stack still counts it until the sample is released
+struct profile_sample *profile_detach(void *ptr)
+{
+	size_t slot = hash_ptr(ptr, PROFILE_FILTER_SIZE);
+
+	if (!__atomic_load_n(&sampled_filter[slot], __ATOMIC_RELAXED))
+		return NULL;
+
+	lock_profile();
+
+	struct profile_sample **link = &sample_buckets[hash_ptr(ptr, PROFILE_SAMPLE_BUCKETS)];
+
+	while (*link && (*link)->ptr != ptr)
+		link = &(*link)->next;
+
+	struct profile_sample *sample = *link;
+
+	if (sample) {
+		*link = sample->next;
+
+		__atomic_store_n(&sampled_filter[slot], sampled_filter[slot] - 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&profiled_blocks, profiled_blocks - 1, __ATOMIC_RELAXED);
+	}
+
+	unlock_profile();
+
+	return sample;
+}
+
+// Put back a sample whose block turned out to stay allocated
+void profile_attach(struct profile_sample *sample)
+{
+	lock_profile();
+	link_sample(sample);
+	unlock_profile();
+}
+
+void profile_release(struct profile_sample *sample)
+{
+	lock_profile();
+
+	sample->stack->live_count--;
+	sample->stack->live_bytes -= sample->size;
+
+	sample->next = free_samples;
+	free_samples = sample;
+
+	unlock_profile();
+}
+
+void profile_free(void *ptr)
+{
+	struct profile_sample *sample = profile_detach(ptr);
+
+	if (sample)
+		profile_release(sample);
+}
+
+// The profile is written without allocating, through a buffer on the stack
+struct profile_writer {
+	int fd;
+	int error;
+	size_t len;
+	char buf[4096];
+};
+
+static void writer_flush(struct profile_writer *writer)
+{
+	char *data = writer->buf;
+
+	while (writer->len && !writer->error) {
+		ssize_t ret = write(writer->fd, data, writer->len);
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+
+		if (ret <= 0) {
+			writer->error = 1;
+			break;
+		}
+
+		data += ret;
+		writer->len -= ret;
+	}
+
+	writer->len = 0;
+}
+
+static void writer_put(struct profile_writer *writer, const char *str, size_t len)
+{
+	if (writer->len + len > sizeof(writer->buf))
+		writer_flush(writer);
+
+	memcpy(writer->buf + writer->len, str, len);
+	writer->len += len;
+}
+
+static void write_counts(struct profile_writer *writer, size_t live_count, size_t live_bytes,
+						 size_t alloc_count, size_t alloc_bytes)
+{
+	char line[128];
+	int len = snprintf(line, sizeof(line), "%lu: %lu [%lu: %lu] @", (unsigned long)live_count,
+					   (unsigned long)live_bytes, (unsigned long)alloc_count, (unsigned long)alloc_bytes);
+
+	writer_put(writer, line, len);
+}
+
+// The mappings let pprof symbolize the addresses
+static void write_maps(struct profile_writer *writer)
+{
+	int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1)
+		return;
+
+	writer_put(writer, "\nMAPPED_LIBRARIES:\n", 19);
+	writer_flush(writer);
+
+	for (;;) {
+		ssize_t ret = read(fd, writer->buf, sizeof(writer->buf));
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			break;
+
+		writer->len = ret;
+		writer_flush(writer);
+	}
+
+	close(fd);
+}
+
+/*
+ * Legacy heap profile text format of pprof: a header with the totals and
+ * the sampling interval, then a line per call stack with its live and total
+ * sampled objects and bytes. pprof scales the samples back by the interval.
+ */
+int profile_dump(const char *path)
+{
+	char name[PATH_MAX];
+	char line[64];
+	struct profile_writer writer = { 0 };
+	size_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+
+	expand_pid_path(name, sizeof(name), path);
+
+	writer.fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (writer.fd == -1)
+		return -1;
+
+	lock_profile();
+
+	for (size_t i = 0; i < PROFILE_STACK_BUCKETS; i++) {
+		for (struct profile_stack *stack = stack_buckets[i]; stack; stack = stack->next) {
+			live_count += stack->live_count;
+			live_bytes += stack->live_bytes;
+			alloc_count += stack->alloc_count;
+			alloc_bytes += stack->alloc_bytes;
+		}
+	}
+
+	writer_put(&writer, "heap profile: ", 14);
+	write_counts(&writer, live_count, live_bytes, alloc_count, alloc_bytes);
+
+	size_t sample = __atomic_load_n(&profile_sample, __ATOMIC_RELAXED);
+	int len = snprintf(line, sizeof(line), " heap_v2/%lu\n", (unsigned long)(sample ? sample : PROFILE_DEFAULT_SAMPLE));
+
+	writer_put(&writer, line, len);
+
+	for (size_t i = 0; i < PROFILE_STACK_BUCKETS; i++) {
+		for (struct profile_stack *stack = stack_buckets[i]; stack; stack = stack->next) {
+			write_counts(&writer, stack->live_count, stack->live_bytes, stack->alloc_count, stack->alloc_bytes);
+
+			for (int frame = 0; frame < stack->depth; frame++) {
+				len = snprintf(line, sizeof(line), " 0x%lx", (unsigned long)stack->pcs[frame]);
+				writer_put(&writer, line, len);
+			}
+
+			writer_put(&writer, "\n", 1);
+		}
+	}
+
+	unlock_profile();
+
+	write_maps(&writer);
+	writer_flush(&writer);
+	close(writer.fd);
+
+	return writer.error ? -1 : 0;
+}
+
+void profile_dump_at_exit(const char *path)
+{
+	exit_path = path;
+}
+
+static void __attribute__((destructor)) profile_exit(void)
+{
+	if (exit_path)
+		profile_dump(exit_path);
+}
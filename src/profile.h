@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Sampling interval used when a profile is asked for at exit without one
+#define PROFILE_DEFAULT_SAMPLE (512 * 1024)
+
+// Frames kept for every sampled allocation
+#define PROFILE_MAX_DEPTH 32
+
+// Buckets of the sampled blocks, of the call stacks and counters of the free filter
+#define PROFILE_SAMPLE_BUCKETS 4096
+#define PROFILE_STACK_BUCKETS 1024
+#define PROFILE_FILTER_SIZE 16384
+
+// Sampled call stack, with what its allocations hold now and held since the start
+struct profile_stack {
+	struct profile_stack *next;
+	uint64_t hash;
+
+	size_t live_count;
+	size_t live_bytes;
+	size_t alloc_count;
+	size_t alloc_bytes;
+
+	int depth;
+	void *pcs[PROFILE_MAX_DEPTH];
+};
+
+struct profile_sample {
+	struct profile_sample *next;
+	void *ptr;
+	size_t size;
+	struct profile_stack *stack;
+};
+
+int init_profiler(void);
+
+void profile_alloc(void *ptr, size_t size);
+
+void profile_free(void *ptr);
+
+struct profile_sample *profile_detach(void *ptr);
+
+void profile_attach(struct profile_sample *sample);
+
+void profile_release(struct profile_sample *sample);
+
+int profile_dump(const char *path);
+
+void profile_dump_at_exit(const char *path);
@@ -0,0 +1,351 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "slab.h"
+#include "alloc_helpers.h"
+#include "arena.h"
+
+// The slots start right after the slab header
+#define SLAB_HEADER_SIZE ((sizeof(struct slab) + SLAB_ALIGNMENT - 1) & ~(SLAB_ALIGNMENT - 1))
+
+static struct slab_class slab_classes[SLAB_CLASSES];
+
+// Reserved area, slabs are carved from it in address order
+static char *slab_area;
+static char *slab_area_next;
+
+// Slabs that got completely free, ready for any class
+static struct slab *empty_slabs;
+
+// Whether the class locks were taken before a fork
+static int slabs_locked;
+
+// Slots of the carved slabs and their payload, changed under the different class locks
+static size_t slab_slots;
+static size_t slab_used_bytes;
+static size_t slab_free_bytes;
+
+int init_slabs(void)
+{
+	int ret = 0;
+
+	lock_heap();
+
+	if (slab_area)
+		goto out;
+
+	// Reserve one more slab to be able to align the area on the slab size
+	char *mem = mmap(NULL, SLAB_AREA_SIZE + SLAB_SIZE, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (mem == (void *) -1) {
+		ret = -1;
+		goto out;
+	}
+
+	char *area = (char *)(((uintptr_t)mem + SLAB_SIZE - 1) & ~(SLAB_SIZE - 1));
+
+	// Give back the unaligned edges of the reservation
+	if (area != mem)
+		DIE(munmap(mem, area - mem) == -1, "Error at munmap in init slabs\n");
+	DIE(munmap(area + SLAB_AREA_SIZE, SLAB_SIZE - (area - mem)) == -1, "Error at munmap in init slabs\n");
+
+	for (int i = 0; i < SLAB_CLASSES; i++)
+		pthread_mutex_init(&slab_classes[i].lock, NULL);
+
+	slab_area_next = area;
+	__atomic_store_n(&slab_area, area, __ATOMIC_RELEASE);
+
+out:
+	unlock_heap();
+
+	if (!ret)
+		register_fork_handlers();
+
+	return ret;
+}
+
+int is_slab_ptr(void *ptr)
+{
+	char *area = __atomic_load_n(&slab_area, __ATOMIC_ACQUIRE);
+
+	return area && (char *)ptr >= area && (char *)ptr < area + SLAB_AREA_SIZE;
+}
+
+static struct slab *get_slab(void *ptr)
+{
+	return (struct slab *)((uintptr_t)ptr & ~(SLAB_SIZE - 1));
+}
+
+size_t slab_slot_size(void *ptr)
+{
+	return get_slab(ptr)->slot_size;
+}
+
+static struct slab *new_slab(unsigned int class)
+{
+	struct slab *slab = NULL;
+
+	lock_heap();
+
+	int reused = 0;
+
+	// Reuse an empty slab before carving a new one
+	if (empty_slabs) {
+		slab = empty_slabs;
+		empty_slabs = slab->next;
+		reused = 1;
+	} else if (slab_area_next < slab_area + SLAB_AREA_SIZE) {
+		slab = (struct slab *)slab_area_next;
+		slab_area_next += SLAB_SIZE;
+	}
+
+	unlock_heap();
+
+	if (!slab)
+		return NULL;
+
+	// An empty slab still has the slots of its old class, they are all free
+	if (reused) {
+		__atomic_sub_fetch(&slab_slots, slab->total_slots, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&slab_free_bytes, (size_t)slab->total_slots * slab->slot_size, __ATOMIC_RELAXED);
+	}
+
+	slab->class = class;
+	slab->slot_size = (class + 1) * SLAB_ALIGNMENT;
+	slab->total_slots = (SLAB_SIZE - SLAB_HEADER_SIZE) / slab->slot_size;
+	slab->free_slots = slab->total_slots;
+	slab->clean_slot = reused ? slab->total_slots : 0;
+	slab->prev = NULL;
+	slab->next = NULL;
+
+	__atomic_add_fetch(&slab_slots, slab->total_slots, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&slab_free_bytes, (size_t)slab->total_slots * slab->slot_size, __ATOMIC_RELAXED);
+
+	// Mark every slot as free
+	for (unsigned int word = 0; word < SLAB_MAP_WORDS; word++) {
+		unsigned int first = word * 64;
+
+		if (first + 64 <= slab->total_slots)
+			slab->free_map[word] = ~(uint64_t)0;
+		else if (first < slab->total_slots)
+			slab->free_map[word] = ((uint64_t)1 << (slab->total_slots - first)) - 1;
+		else
+			slab->free_map[word] = 0;
+	}
+
+	return slab;
+}
+
+static void push_partial(struct slab_class *slab_class, struct slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = slab_class->partial;
+
+	if (slab->next)
+		slab->next->prev = slab;
+
+	slab_class->partial = slab;
+}
+
+static void remove_partial(struct slab_class *slab_class, struct slab *slab)
+{
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		slab_class->partial = slab->next;
+
+	if (slab->next)
+		slab->next->prev = slab->prev;
+
+	slab->prev = NULL;
+	slab->next = NULL;
+}
+
+// Take a free slot of the class, whose lock is held, and tell if it may hold old data
+static void *claim_slot(struct slab_class *slab_class, unsigned int class, int *dirty)
+{
+	struct slab *slab = slab_class->partial;
+
+	if (!slab) {
+		// The heap lock is never held while waiting for a class lock
+		pthread_mutex_unlock(&slab_class->lock);
+		slab = new_slab(class);
+		pthread_mutex_lock(&slab_class->lock);
+		if (!slab)
+			return NULL;
+		push_partial(slab_class, slab);
+	}
+
+	// A slab in the partial list always has a free slot
+	unsigned int word = 0;
+
+	while (!slab->free_map[word])
+		word++;
+
+	unsigned int slot = word * 64 + __builtin_ctzll(slab->free_map[word]);
+
+	slab->free_map[word] &= slab->free_map[word] - 1;
+
+	if (--slab->free_slots == 0)
+		remove_partial(slab_class, slab);
+
+	__atomic_add_fetch(&slab_used_bytes, slab->slot_size, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&slab_free_bytes, slab->slot_size, __ATOMIC_RELAXED);
+
+	*dirty = slot < slab->clean_slot;
+
+	if (!*dirty)
+		slab->clean_slot = slot + 1;
+
+	return (char *)slab + SLAB_HEADER_SIZE + slot * slab->slot_size;
+}
+
+void *slab_alloc(size_t size, int zero)
+{
+	unsigned int class = (size - 1) / SLAB_ALIGNMENT;
+	struct slab_class *slab_class = &slab_classes[class];
+	int dirty;
+
+	pthread_mutex_lock(&slab_class->lock);
+	void *ptr = claim_slot(slab_class, class, &dirty);
+	pthread_mutex_unlock(&slab_class->lock);
+
+	if (ptr && zero && dirty)
+		memset(ptr, 0, size);
+
+	return ptr;
+}
+
+size_t slab_alloc_batch(size_t size, void **ptrs, size_t count)
+{
+	unsigned int class = (size - 1) / SLAB_ALIGNMENT;
+	struct slab_class *slab_class = &slab_classes[class];
+	size_t done = 0;
+	int dirty;
+
+	pthread_mutex_lock(&slab_class->lock);
+
+	for (; done < count; done++) {
+		ptrs[done] = claim_slot(slab_class, class, &dirty);
+		if (!ptrs[done])
+			break;
+	}
+
+	pthread_mutex_unlock(&slab_class->lock);
+
+	return done;
+}
+
+// Give a slot back to its slab, with the lock of its class held
+static void release_slot(struct slab_class *slab_class, void *ptr)
+{
+	struct slab *slab = get_slab(ptr);
+	unsigned int slot = ((char *)ptr - (char *)slab - SLAB_HEADER_SIZE) / slab->slot_size;
+	uint64_t bit = (uint64_t)1 << (slot % 64);
+
+	// Ignore slots that are already free
+	if (slab->free_map[slot / 64] & bit)
+		return;
+
+	slab->free_map[slot / 64] |= bit;
+
+	__atomic_sub_fetch(&slab_used_bytes, slab->slot_size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&slab_free_bytes, slab->slot_size, __ATOMIC_RELAXED);
+
+	if (slab->free_slots++ == 0)
+		push_partial(slab_class, slab);
+
+	// Keep the last partial slab of the class, give the other empty ones away
+	if (slab->free_slots == slab->total_slots && (slab_class->partial != slab || slab->next)) {
+		remove_partial(slab_class, slab);
+
+		lock_heap();
+		slab->next = empty_slabs;
+		empty_slabs = slab;
+		unlock_heap();
+	}
+}
+
+void slab_free(void *ptr)
+{
+	struct slab_class *slab_class = &slab_classes[get_slab(ptr)->class];
+
+	pthread_mutex_lock(&slab_class->lock);
+	release_slot(slab_class, ptr);
+	pthread_mutex_unlock(&slab_class->lock);
+}
+
+void slab_free_batch(void **ptrs, size_t count)
+{
+	struct slab_class *locked = NULL;
+
+	// Slots of the same class are freed under a single lock
+	for (size_t i = 0; i < count; i++) {
+		struct slab_class *slab_class = &slab_classes[get_slab(ptrs[i])->class];
+
+		if (slab_class != locked) {
+			if (locked)
+				pthread_mutex_unlock(&locked->lock);
+			pthread_mutex_lock(&slab_class->lock);
+			locked = slab_class;
+		}
+
+		release_slot(slab_class, ptrs[i]);
+	}
+
+	if (locked)
+		pthread_mutex_unlock(&locked->lock);
+}
+
+void add_slab_stats(struct osmem_stats *stats)
+{
+	char *area = __atomic_load_n(&slab_area, __ATOMIC_ACQUIRE);
+
+	if (!area)
+		return;
+
+	// Carved slabs stay carved, the empty ones wait for any class with their slots free
+	stats->heap_size += (char *)__atomic_load_n(&slab_area_next, __ATOMIC_RELAXED) - area;
+	stats->block_count += __atomic_load_n(&slab_slots, __ATOMIC_RELAXED);
+	stats->used_bytes += __atomic_load_n(&slab_used_bytes, __ATOMIC_RELAXED);
+	stats->free_bytes += __atomic_load_n(&slab_free_bytes, __ATOMIC_RELAXED);
+}
+
+struct slab *first_slab(void)
+{
+	char *area = __atomic_load_n(&slab_area, __ATOMIC_ACQUIRE);
+
+	if (!area || area == slab_area_next)
+		return NULL;
+
+	return (struct slab *)area;
+}
+
+struct slab *get_next_slab(struct slab *slab)
+{
+	char *next = (char *)slab + SLAB_SIZE;
+
+	return next < slab_area_next ? (struct slab *)next : NULL;
+}
+
+void lock_slabs(void)
+{
+	if (!__atomic_load_n(&slab_area, __ATOMIC_ACQUIRE))
+		return;
+
+	for (int i = 0; i < SLAB_CLASSES; i++)
+		pthread_mutex_lock(&slab_classes[i].lock);
+
+	slabs_locked = 1;
+}
+
+void unlock_slabs(void)
+{
+	if (!slabs_locked)
+		return;
+
+	slabs_locked = 0;
+
+	for (int i = SLAB_CLASSES - 1; i >= 0; i--)
+		pthread_mutex_unlock(&slab_classes[i].lock);
+}
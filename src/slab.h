@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "block_meta.h"
+#include "os_utils.h"
+#include "osmem.h"
+
+// Objects of up to SLAB_MAX_SIZE bytes live in slots of a multiple of SLAB_ALIGNMENT
+#define SLAB_ALIGNMENT 16
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_ALIGNMENT)
+
+// Slabs are aligned on their size, so a slot finds its slab by masking its address
+#define SLAB_SIZE (16UL * 1024)
+#define SLAB_MAP_WORDS (SLAB_SIZE / SLAB_ALIGNMENT / 64)
+
+// Address space reserved for all the slabs
+#define SLAB_AREA_SIZE (256UL * 1024 * 1024)
+
+// Header at the start of every slab, the slots follow it
+struct slab {
+	// One bit set for every free slot
+	uint64_t free_map[SLAB_MAP_WORDS];
+
+	// Link in the list of partially used slabs of its class
+	struct slab *prev;
+	struct slab *next;
+
+	unsigned int class;
+	unsigned int slot_size;
+	unsigned int total_slots;
+	unsigned int free_slots;
+
+	// Slots from this one on were never handed out, so they are still zero
+	unsigned int clean_slot;
+};
+
+// Partially used slabs of a size class
+struct slab_class {
+	pthread_mutex_t lock;
+	struct slab *partial;
+};
+
+int init_slabs(void);
+
+int is_slab_ptr(void *ptr);
+
+size_t slab_slot_size(void *ptr);
+
+void *slab_alloc(size_t size, int zero);
+
+size_t slab_alloc_batch(size_t size, void **ptrs, size_t count);
+
+void slab_free(void *ptr);
+
+void slab_free_batch(void **ptrs, size_t count);
+
+void add_slab_stats(struct osmem_stats *stats);
+
+// Every slab carved so far in address order, the empty ones included
+struct slab *first_slab(void);
+
+struct slab *get_next_slab(struct slab *slab);
+
+void lock_slabs(void);
+
+void unlock_slabs(void);
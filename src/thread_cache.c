@@ -0,0 +1,220 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "thread_cache.h"
+#include "alloc_helpers.h"
+#include "block_meta_list.h"
+
+extern size_t blk_meta_size;
+
+extern struct arena main_arena;
+
+// Initial-exec TLS never allocates, even when the library is preloaded
+static __thread struct thread_cache tcache __attribute__((tls_model("initial-exec")));
+
+// Caches are only used once a second thread starts allocating
+static int known_threads;
+static int multi_threaded;
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+static void tcache_flush(struct thread_cache *cache, size_t bin, unsigned int count)
+{
+	struct arena *locked = NULL;
+
+	// Give the cached blocks back to the arenas they belong to
+	while (count-- && cache->bins[bin]) {
+		struct block_meta *block = cache->bins[bin];
+		struct arena *arena = get_blk_arena(block);
+
+		if (arena != locked) {
+			if (locked)
+				unlock_arena(locked);
+			lock_arena(arena);
+			drain_remote_frees(arena);
+			locked = arena;
+		}
+
+		cache->bins[bin] = block->next;
+		cache->counts[bin]--;
+		free_brk_blk(arena, block, blk_meta_size);
+	}
+
+	if (locked)
+		unlock_arena(locked);
+}
+
+static void tcache_slab_flush(struct thread_cache *cache, size_t class, unsigned int count)
+{
+	void *ptrs[TCACHE_COUNT];
+	unsigned int done = 0;
+
+	while (done < count && cache->slab_bins[class]) {
+		ptrs[done] = cache->slab_bins[class];
+		cache->slab_bins[class] = *(void **)ptrs[done];
+		cache->slab_counts[class]--;
+		done++;
+	}
+
+	slab_free_batch(ptrs, done);
+}
+
+static void tcache_destroy(void *arg)
+{
+	struct thread_cache *cache = arg;
+
+	for (size_t bin = 0; bin < TCACHE_BINS; bin++)
+		tcache_flush(cache, bin, TCACHE_COUNT);
+
+	for (size_t class = 0; class < SLAB_CLASSES; class++)
+		tcache_slab_flush(cache, class, TCACHE_COUNT);
+
+	// Allocations made by later destructors go straight to the shared heap
+	cache->state = TCACHE_DISABLED;
+}
+
+static void tcache_init_once(void)
+{
+	DIE(pthread_key_create(&tcache_key, tcache_destroy), "Error at pthread_key_create\n");
+	register_fork_handlers();
+}
+
+static int tcache_usable(void)
+{
+	if (tcache.state == TCACHE_ACTIVE)
+		return 1;
+
+	if (tcache.state == TCACHE_DISABLED)
+		return 0;
+
+	if (tcache.state == TCACHE_NEW) {
+		lock_heap();
+		if (++known_threads > 1)
+			__atomic_store_n(&multi_threaded, 1, __ATOMIC_RELAXED);
+		unlock_heap();
+
+		tcache.state = TCACHE_SINGLE;
+	}
+
+	if (!__atomic_load_n(&multi_threaded, __ATOMIC_RELAXED))
+		return 0;
+
+	// Register the cache so it gets flushed when the thread exits, what gets allocated meanwhile is not cached
+	tcache.state = TCACHE_DISABLED;
+	pthread_once(&tcache_once, tcache_init_once);
+	pthread_setspecific(tcache_key, &tcache);
+	tcache.state = TCACHE_ACTIVE;
+
+	return 1;
+}
+
+static void tcache_refill(size_t bin, size_t blk_size)
+{
+	lock_arena(&main_arena);
+
+	for (int i = 0; i < TCACHE_BATCH; i++) {
+		struct block_meta *block = alloc_brk_blk(&main_arena, blk_size, NULL);
+
+		if (!block)
+			break;
+
+		// The first block of the heap is the whole preallocated chunk, only cache what the bin is for
+		if (block->size > TCACHE_MAX_SIZE)
+			split_blk(&main_arena, block, blk_size, blk_meta_size);
+
+		block->next = tcache.bins[bin];
+		tcache.bins[bin] = block;
+		tcache.counts[bin]++;
+	}
+
+	unlock_arena(&main_arena);
+}
+
+struct block_meta *tcache_get(size_t blk_size)
+{
+	if (blk_size > TCACHE_MAX_SIZE || !tcache_usable())
+		return NULL;
+
+	size_t bin = blk_size / ALIGNMENT - 1;
+
+	// Take a batch of blocks from the shared heap at once
+	if (!tcache.bins[bin])
+		tcache_refill(bin, blk_size);
+
+	struct block_meta *block = tcache.bins[bin];
+
+	if (!block)
+		return NULL;
+
+	tcache.bins[bin] = block->next;
+	tcache.counts[bin]--;
+	block->next = NULL;
+
+	return block;
+}
+
+int tcache_put(struct block_meta *block, size_t blk_size)
+{
+	if (blk_size > TCACHE_MAX_SIZE || !tcache_usable())
+		return 0;
+
+	size_t bin = blk_size / ALIGNMENT - 1;
+
+	// Make room by giving half of a full bin back to the shared heap
+	if (tcache.counts[bin] == TCACHE_COUNT)
+		tcache_flush(&tcache, bin, TCACHE_BATCH);
+
+	// Cached blocks stay allocated, so they are never merged with their neighbours
+	block->next = tcache.bins[bin];
+	tcache.bins[bin] = block;
+	tcache.counts[bin]++;
+
+	return 1;
+}
+
+void *tcache_slab_get(size_t blk_size)
+{
+	if (!tcache_usable())
+		return NULL;
+
+	size_t class = (blk_size - 1) / SLAB_ALIGNMENT;
+
+	// Claim a batch of slots under a single lock of the class
+	if (!tcache.slab_bins[class]) {
+		void *ptrs[TCACHE_BATCH];
+		size_t count = slab_alloc_batch(blk_size, ptrs, TCACHE_BATCH);
+
+		for (size_t i = 0; i < count; i++) {
+			*(void **)ptrs[i] = tcache.slab_bins[class];
+			tcache.slab_bins[class] = ptrs[i];
+		}
+		tcache.slab_counts[class] += count;
+
+		if (!count)
+			return NULL;
+	}
+
+	void *ptr = tcache.slab_bins[class];
+
+	tcache.slab_bins[class] = *(void **)ptr;
+	tcache.slab_counts[class]--;
+
+	return ptr;
+}
+
+int tcache_slab_put(void *ptr)
+{
+	if (!tcache_usable())
+		return 0;
+
+	size_t class = slab_slot_size(ptr) / SLAB_ALIGNMENT - 1;
+
+	if (tcache.slab_counts[class] == TCACHE_COUNT)
+		tcache_slab_flush(&tcache, class, TCACHE_BATCH);
+
+	*(void **)ptr = tcache.slab_bins[class];
+	tcache.slab_bins[class] = ptr;
+	tcache.slab_counts[class]++;
+
+	return 1;
+}
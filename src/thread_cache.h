@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "block_meta.h"
+#include "os_utils.h"
+#include "slab.h"
+
+// Blocks of up to TCACHE_MAX_SIZE bytes are cached, one bin for every aligned size
+#define TCACHE_MAX_SIZE 512
+#define TCACHE_BINS (TCACHE_MAX_SIZE / ALIGNMENT)
+
+// Maximum number of blocks kept in a bin and how many are moved at once
+#define TCACHE_COUNT 16
+#define TCACHE_BATCH (TCACHE_COUNT / 2)
+
+// Thread cache states
+#define TCACHE_NEW      0
+#define TCACHE_SINGLE   1
+#define TCACHE_ACTIVE   2
+#define TCACHE_DISABLED 3
+
+struct thread_cache {
+	struct block_meta *bins[TCACHE_BINS];
+	unsigned short counts[TCACHE_BINS];
+
+	// Free slab slots of every class, linked through their first word
+	void *slab_bins[SLAB_CLASSES];
+	unsigned short slab_counts[SLAB_CLASSES];
+
+	int state;
+};
+
+struct block_meta *tcache_get(size_t blk_size);
+
+int tcache_put(struct block_meta *block, size_t blk_size);
+
+void *tcache_slab_get(size_t blk_size);
+
+int tcache_slab_put(void *ptr);
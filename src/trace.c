@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "alloc_helpers.h"
+
+extern int tracing;
+
+/*
+ * A buffer belongs to a single thread while it runs, and is handed to the
+ * next thread once it exits. Buffers are never unmapped, so the ones still
+ * in use can be written out when the process exits.
+ */
+struct trace_buffer {
+	struct trace_buffer *next;
+	struct trace_buffer *next_free;
+
+	uint32_t thread;
+	uint32_t count;
+	struct trace_record records[TRACE_BUFFER_RECORDS];
+};
+
+// Serializes the writes to the trace file and protects the buffer lists
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int trace_fd = -1;
+static uint64_t trace_start_ns;
+
+static struct trace_buffer *trace_buffers;
+static struct trace_buffer *free_trace_buffers;
+
+// Initial-exec TLS never allocates, even when the library is preloaded
+static __thread struct trace_buffer *trace_buf __attribute__((tls_model("initial-exec")));
+
+// Set while a buffer is set up, the allocations made meanwhile are not recorded
+static __thread int trace_busy __attribute__((tls_model("initial-exec")));
+
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Must be called with the trace lock held
+static void write_records(struct trace_buffer *buf)
+{
+	char *data = (char *)buf->records;
+	size_t len = buf->count * sizeof(struct trace_record);
+
+	while (len) {
+		ssize_t ret = write(trace_fd, data, len);
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+
+		DIE(ret == -1, "Error at write in trace\n");
+		data += ret;
+		len -= ret;
+	}
+
+	buf->count = 0;
+}
+
+static void release_buffer(void *arg)
+{
+	struct trace_buffer *buf = arg;
+
+	pthread_mutex_lock(&trace_lock);
+
+	if (trace_fd != -1)
+		write_records(buf);
+
+	buf->count = 0;
+	buf->next_free = free_trace_buffers;
+	free_trace_buffers = buf;
+
+	pthread_mutex_unlock(&trace_lock);
+
+	// Allocations made by later destructors get a buffer of their own
+	trace_buf = NULL;
+}
+
+static void trace_init_once(void)
+{
+	DIE(pthread_key_create(&trace_key, release_buffer), "Error at pthread_key_create in trace\n");
+}
+
+static struct trace_buffer *get_buffer(void)
+{
+	struct trace_buffer *buf;
+
+	trace_busy = 1;
+	pthread_once(&trace_once, trace_init_once);
+
+	pthread_mutex_lock(&trace_lock);
+	buf = free_trace_buffers;
+	if (buf)
+		free_trace_buffers = buf->next_free;
+	pthread_mutex_unlock(&trace_lock);
+
+	if (!buf) {
+		buf = mmap(NULL, sizeof(*buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		DIE(buf == MAP_FAILED, "Error at mmap in trace\n");
+
+		pthread_mutex_lock(&trace_lock);
+		buf->next = trace_buffers;
+		trace_buffers = buf;
+		pthread_mutex_unlock(&trace_lock);
+	}
+
+	buf->thread = syscall(SYS_gettid);
+	buf->count = 0;
+
+	// Flush the buffer when the thread exits
+	pthread_setspecific(trace_key, buf);
+
+	trace_buf = buf;
+	trace_busy = 0;
+
+	return buf;
+}
+
+void trace_event(uint32_t op, void *ptr, size_t size, uintptr_t arg)
+{
+	if (trace_busy)
+		return;
+
+	struct trace_buffer *buf = trace_buf ? trace_buf : get_buffer();
+	struct trace_record *record = &buf->records[buf->count];
+
+	record->time = now_ns() - trace_start_ns;
+	record->size = size;
+	record->ptr = (uintptr_t)ptr;
+	record->arg = arg;
+	record->thread = buf->thread;
+	record->op = op;
+
+	// Only complete records get written when the process exits
+	__atomic_store_n(&buf->count, buf->count + 1, __ATOMIC_RELEASE);
+
+	if (buf->count < TRACE_BUFFER_RECORDS)
+		return;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fd != -1)
+		write_records(buf);
+	else
+		buf->count = 0;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+// The child of a fork does not write to the trace of its parent
+static void trace_fork_child(void)
+{
+	__atomic_store_n(&tracing, 0, __ATOMIC_RELAXED);
+	pthread_mutex_init(&trace_lock, NULL);
+
+	if (trace_fd != -1)
+		close(trace_fd);
+	trace_fd = -1;
+}
+
+void expand_pid_path(char *name, size_t size, const char *path)
+{
+	const char *pid_at = strstr(path, "%p");
+
+	// "%p" is replaced with the process id, so that the processes of a program get a file each
+	if (pid_at)
+		snprintf(name, size, "%.*s%d%s", (int)(pid_at - path), path, getpid(), pid_at + 2);
+	else
+		snprintf(name, size, "%s", path);
+}
+
+int trace_start(const char *path)
+{
+	char name[PATH_MAX];
+	struct trace_header header = { .version = TRACE_VERSION, .record_size = sizeof(struct trace_record) };
+
+	if (trace_fd != -1)
+		return -1;
+
+	expand_pid_path(name, sizeof(name), path);
+
+	int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (fd == -1)
+		return -1;
+
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+		close(fd);
+		return -1;
+	}
+
+	DIE(pthread_atfork(NULL, NULL, trace_fork_child), "Error at pthread_atfork in trace\n");
+
+	trace_start_ns = now_ns();
+	trace_fd = fd;
+	__atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static void __attribute__((destructor)) trace_stop(void)
+{
+	if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_store_n(&tracing, 0, __ATOMIC_RELAXED);
+
+	// Threads that are still running may lose the records they are making right now
+	pthread_mutex_lock(&trace_lock);
+
+	for (struct trace_buffer *buf = trace_buffers; buf; buf = buf->next)
+		if (__atomic_load_n(&buf->count, __ATOMIC_ACQUIRE))
+			write_records(buf);
+
+	close(trace_fd);
+	trace_fd = -1;
+
+	pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+ * Trace files start with a struct trace_header followed by fixed-size
+ * records. Every thread fills its own buffer and writes it out as a whole,
+ * so the records of different threads are interleaved in chunks and have to
+ * be ordered by their time to be replayed.
+ */
+#define TRACE_MAGIC "OSMTRACE"
+#define TRACE_VERSION 1
+
+// Operations, a free is recorded before it happens and the others after they return
+#define TRACE_MALLOC   1
+#define TRACE_CALLOC   2
+#define TRACE_REALLOC  3
+#define TRACE_FREE     4
+#define TRACE_MEMALIGN 5
+
+// Records buffered by a thread before they are written out
+#define TRACE_BUFFER_RECORDS 1024
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+};
+
+struct trace_record {
+	// Nanoseconds since the trace was started
+	uint64_t time;
+
+	// Bytes asked for, nmemb * size for calloc
+	uint64_t size;
+
+	// Pointer returned, or freed for TRACE_FREE
+	uint64_t ptr;
+
+	// Pointer given to realloc, or the alignment of memalign
+	uint64_t arg;
+
+	uint32_t thread;
+	uint32_t op;
+};
+
+void expand_pid_path(char *name, size_t size, const char *path);
+
+int trace_start(const char *path);
+
+void trace_event(uint32_t op, void *ptr, size_t size, uintptr_t arg);
@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+/* Runs on libosmem_preload.so, through the standard entry points */
+#define FAIL(assertion, feedback)										\
+	do {													\
+		if (assertion) {										\
+			fprintf(stderr, "(%s, %d): %s\n", __FILE__, __LINE__, feedback);			\
+			exit(EXIT_FAILURE);									\
+		}												\
+	} while (0)
+
+#define MAX_ALIGN _Alignof(max_align_t)
+
+#define COUNT 200
+
+/* Past the mmap threshold */
+#define LARGE_SIZE (256 * 1024)
+
+int main(void)
+{
+	void *ptrs[COUNT];
+
+	for (size_t size = 1; size < COUNT; size++) {
+		ptrs[size] = malloc(size);
+		FAIL((uintptr_t)ptrs[size] % MAX_ALIGN, "malloc returned a block too loosely aligned for any type");
+	}
+
+	/* Reused blocks and blocks resized in place keep the alignment */
+	for (size_t size = 1; size < COUNT; size += 2)
+		free(ptrs[size]);
+
+	for (size_t size = 1; size < COUNT; size += 2) {
+		ptrs[size] = calloc(1, size);
+		FAIL((uintptr_t)ptrs[size] % MAX_ALIGN, "calloc returned a block too loosely aligned for any type");
+	}
+
+	for (size_t size = 1; size < COUNT; size++) {
+		ptrs[size] = realloc(ptrs[size], size * 3);
+		FAIL((uintptr_t)ptrs[size] % MAX_ALIGN, "realloc returned a block too loosely aligned for any type");
+	}
+
+	for (size_t size = 1; size < COUNT; size++)
+		free(ptrs[size]);
+
+	/* A mapped block is recognized as one of ours without a header lookup going wrong */
+	char *large = malloc(LARGE_SIZE);
+
+	FAIL((uintptr_t)large % MAX_ALIGN, "mapped block is too loosely aligned for any type");
+	FAIL(malloc_usable_size(large) < LARGE_SIZE, "mapped block was not recognized as allocated");
+	memset(large, 0x5a, LARGE_SIZE);
+
+	large = realloc(large, 2 * LARGE_SIZE);
+	FAIL(large[LARGE_SIZE - 1] != 0x5a, "mapped block lost its data on realloc");
+	free(large);
+
+	return 0;
+}
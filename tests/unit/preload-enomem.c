@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <sys/resource.h>
+
+/* Runs on libosmem_preload.so, through the standard entry points */
+#define FAIL(assertion, feedback)										\
+	do {													\
+		if (assertion) {										\
+			fprintf(stderr, "(%s, %d): %s\n", __FILE__, __LINE__, feedback);			\
+			exit(EXIT_FAILURE);									\
+		}												\
+	} while (0)
+
+/* More than any machine can map, but a size the allocator has to try */
+#define HUGE_SIZE (1UL << 46)
+
+#define SMALL_SIZE 100
+#define LARGE_SIZE (256 * 1024)
+
+/* Room left to the heap and the mappings when the data limit is lowered */
+#define DATA_ROOM (1024UL * 1024)
+#define MAX_BLOCKS (2 * DATA_ROOM / SMALL_SIZE)
+
+static void *blocks[MAX_BLOCKS];
+
+/* Called through a pointer, the compiler takes every realloc for a successful one */
+static void *(*volatile realloc_fn)(void *, size_t) = realloc;
+
+/* Bytes the data limit counts now, the heap and the private writable mappings */
+static size_t data_size(void)
+{
+	char line[128];
+	size_t size = 0;
+	FILE *status = fopen("/proc/self/status", "r");
+
+	FAIL(!status, "cannot open /proc/self/status");
+	while (fgets(line, sizeof(line), status))
+		if (sscanf(line, "VmData: %zu kB", &size) == 1)
+			break;
+	fclose(status);
+
+	FAIL(!size, "cannot read VmData");
+	return size * 1024;
+}
+
+static void check_enomem(void *ptr, const char *feedback)
+{
+	FAIL(ptr || errno != ENOMEM, feedback);
+	errno = 0;
+}
+
+int main(void)
+{
+	void *ptr;
+
+	errno = 0;
+	check_enomem(malloc(HUGE_SIZE), "malloc did not fail with ENOMEM");
+	check_enomem(calloc(1, HUGE_SIZE), "calloc did not fail with ENOMEM");
+	check_enomem(memalign(4096, HUGE_SIZE), "memalign did not fail with ENOMEM");
+	FAIL(posix_memalign(&ptr, 4096, HUGE_SIZE) != ENOMEM, "posix_memalign did not fail with ENOMEM");
+
+	/* A failed realloc keeps the block and its data, whatever kind of block it is */
+	for (size_t size = SMALL_SIZE; size <= LARGE_SIZE; size += LARGE_SIZE - SMALL_SIZE) {
+		char *block = malloc(size);
+
+		FAIL(!block, "malloc failed");
+		memset(block, 0x5a, size);
+
+		check_enomem(realloc_fn(block, HUGE_SIZE), "realloc did not fail with ENOMEM");
+		FAIL(block[0] != 0x5a || block[size - 1] != 0x5a, "failed realloc changed the block");
+		FAIL(malloc_usable_size(block) < size, "failed realloc freed the block");
+
+		free(block);
+	}
+
+	/* The heap can no longer grow with sbrk once the data limit is reached */
+	struct rlimit old_limit, limit;
+	size_t count = 0;
+
+	FAIL(getrlimit(RLIMIT_DATA, &old_limit), "getrlimit failed");
+	limit = old_limit;
+	limit.rlim_cur = data_size() + DATA_ROOM;
+	FAIL(setrlimit(RLIMIT_DATA, &limit), "setrlimit failed");
+
+	errno = 0;
+	while (count < MAX_BLOCKS && (blocks[count] = malloc(SMALL_SIZE)))
+		count++;
+
+	FAIL(count == MAX_BLOCKS, "the data limit was never reached");
+	FAIL(errno != ENOMEM, "malloc did not fail with ENOMEM at the data limit");
+
+	FAIL(setrlimit(RLIMIT_DATA, &old_limit), "setrlimit failed");
+	while (count)
+		free(blocks[--count]);
+
+	/* The allocator still works afterwards */
+	ptr = malloc(SMALL_SIZE);
+	FAIL(!ptr, "malloc failed after running out of memory");
+	free(ptr);
+
+	return 0;
+}
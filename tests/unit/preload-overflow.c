@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+/* Runs on libosmem_preload.so, through the standard entry points */
+#define FAIL(assertion, feedback)										\
+	do {													\
+		if (assertion) {										\
+			fprintf(stderr, "(%s, %d): %s\n", __FILE__, __LINE__, feedback);			\
+			exit(EXIT_FAILURE);									\
+		}												\
+	} while (0)
+
+#define SMALL_SIZE 100
+#define LARGE_SIZE (256 * 1024)
+
+/* Kept out of the compiler's sight, it would warn about the sizes */
+static volatile size_t size_max = SIZE_MAX;
+
+static void check_enomem(void *ptr, const char *feedback)
+{
+	FAIL(ptr || errno != ENOMEM, feedback);
+	errno = 0;
+}
+
+int main(void)
+{
+	void *ptr;
+
+	/* Sizes that wrap once a header and the alignment are added */
+	for (size_t slack = 0; slack < 64; slack += 7) {
+		size_t size = size_max - slack;
+
+		errno = 0;
+		check_enomem(malloc(size), "malloc of a wrapping size did not fail with ENOMEM");
+		check_enomem(calloc(1, size), "calloc of a wrapping size did not fail with ENOMEM");
+		check_enomem(memalign(64, size), "memalign of a wrapping size did not fail with ENOMEM");
+		check_enomem(aligned_alloc(64, size & ~63UL), "aligned_alloc of a wrapping size did not fail with ENOMEM");
+		FAIL(posix_memalign(&ptr, 64, size) != ENOMEM, "posix_memalign of a wrapping size did not fail with ENOMEM");
+		FAIL(errno, "posix_memalign changed errno");
+	}
+
+	/* Just past the limit, and element counts whose product wraps */
+	check_enomem(malloc(size_max / 2 + 1), "malloc past PTRDIFF_MAX did not fail with ENOMEM");
+	check_enomem(calloc(size_max / 2, 3), "calloc with a wrapping product did not fail with ENOMEM");
+	check_enomem(calloc(3, size_max / 2), "calloc with a wrapping product did not fail with ENOMEM");
+	check_enomem(reallocarray(NULL, size_max / 4, 8), "reallocarray with a wrapping product did not fail");
+
+	/* A refused realloc keeps the block and its data, whatever kind of block it is */
+	for (size_t size = SMALL_SIZE; size <= LARGE_SIZE; size += LARGE_SIZE - SMALL_SIZE) {
+		char *block = malloc(size);
+
+		FAIL(!block, "malloc failed");
+		memset(block, 0x5a, size);
+
+		for (size_t slack = 0; slack < 64; slack += 7)
+			check_enomem(realloc(block, size_max - slack), "realloc to a wrapping size did not fail with ENOMEM");
+		FAIL(block[0] != 0x5a || block[size - 1] != 0x5a, "refused realloc changed the block");
+		FAIL(malloc_usable_size(block) < size, "refused realloc freed the block");
+
+		free(block);
+	}
+
+	/* The allocator still works afterwards */
+	ptr = malloc(SMALL_SIZE);
+	FAIL(!ptr, "malloc failed after refusing a size");
+	free(ptr);
+
+	return 0;
+}
@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdint.h>
+
+#include "unit-utils.h"
+
+/* More than fit in one carved region for the small sizes */
+#define COUNT 3000
+
+/* Slab, heap, and mapped sizes */
+static const size_t sizes[] = { 1, 24, 200, 1000, 5000, 200 * 1024 };
+
+static void *ptrs[COUNT];
+
+static int by_address(const void *a, const void *b)
+{
+	uintptr_t x = *(uintptr_t *)a, y = *(uintptr_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static size_t used_bytes(void)
+{
+	struct osmem_stats stats;
+
+	os_malloc_stats(&stats);
+
+	return stats.used_bytes;
+}
+
+static void check_batch(size_t size)
+{
+	/* Fewer of the mapped ones, each takes its own mapping */
+	size_t count = size > 64 * 1024 ? 16 : COUNT;
+	size_t used = used_bytes();
+
+	FAIL(os_malloc_batch(size, count, ptrs) != count, "batch allocation came back short");
+
+	for (size_t i = 0; i < count; i++) {
+		FAIL(!ptrs[i], "batch allocation returned NULL");
+		FAIL(os_malloc_usable_size(ptrs[i]) < size, "batch block is smaller than asked");
+		memset(ptrs[i], i & 0xff, size);
+	}
+
+	/* No block was overwritten by the others */
+	for (size_t i = 0; i < count; i++)
+		FAIL(((unsigned char *)ptrs[i])[0] != (i & 0xff) || ((unsigned char *)ptrs[i])[size - 1] != (i & 0xff),
+			 "batch blocks overlap");
+
+	FAIL(used_bytes() < used + count * size, "statistics miss the batch blocks");
+
+	qsort(ptrs, count, sizeof(ptrs[0]), by_address);
+	for (size_t i = 1; i < count; i++)
+		FAIL((char *)ptrs[i - 1] + os_malloc_usable_size(ptrs[i - 1]) > (char *)ptrs[i], "batch blocks overlap");
+
+	/* Holes in the array are skipped */
+	void *alone = ptrs[count / 2];
+
+	ptrs[count / 2] = NULL;
+	os_free_batch(ptrs, count);
+	os_free_batch(&alone, 1);
+
+	FAIL(used_bytes() != used, "statistics do not go back after the batch is freed");
+}
+
+static void check_sizes(void)
+{
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		check_batch(sizes[i]);
+}
+
+int main(void)
+{
+	FAIL(os_malloc_batch(0, COUNT, ptrs) != 0, "batch of empty blocks was allocated");
+
+	check_sizes();
+
+	FAIL(!os_mallopt(OSMEM_OPT_SLABS, 1), "cannot turn the slabs on");
+	check_sizes();
+	FAIL(!os_mallopt(OSMEM_OPT_SLABS, 0), "cannot turn the slabs off");
+
+	FAIL(!os_mallopt(OSMEM_OPT_COMPACT_HEADERS, 1), "cannot turn the compact headers on");
+	check_sizes();
+	FAIL(!os_mallopt(OSMEM_OPT_COMPACT_HEADERS, 0), "cannot turn the compact headers off");
+
+	FAIL(!os_mallopt(OSMEM_OPT_PERCPU_ARENAS, 1), "cannot turn the per-CPU arenas on");
+	check_sizes();
+
+	return 0;
+}
@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "unit-utils.h"
+
+#define SIZE 1000
+
+/* Two of them nearly fill the preallocated chunk */
+#define BIG_SIZE (60 * 1024)
+
+/* Every order three neighbours can be freed in, each merge case is covered by one of them */
+static const int orders[][3] = {
+	{0, 1, 2}, {0, 2, 1}, {1, 0, 2}, {1, 2, 0}, {2, 0, 1}, {2, 1, 0},
+};
+
+int main(void)
+{
+	void *ptrs[3], *guard;
+
+	/* Make the preallocated chunk free, the blocks below are carved from its start */
+	os_free(os_malloc(SIZE));
+
+	for (size_t i = 0; i < sizeof(orders) / sizeof(orders[0]); i++) {
+		for (int j = 0; j < 3; j++)
+			ptrs[j] = os_malloc(SIZE);
+
+		/* Keeps the last block away from the free tail of the heap */
+		guard = os_malloc(SIZE);
+
+		FAIL((char *)ptrs[1] - (char *)ptrs[0] != SIZE + METADATA_SIZE ||
+			 (char *)ptrs[2] - (char *)ptrs[1] != SIZE + METADATA_SIZE, "blocks are not adjacent");
+
+		size_t blocks = heap_block_count();
+
+		for (int j = 0; j < 3; j++)
+			os_free(ptrs[orders[i][j]]);
+
+		/* The three blocks merge into one as soon as they are freed */
+		FAIL(heap_block_count() != blocks - 2, "freed neighbours were not merged");
+
+		/* The merged block is the best fit for its exact size */
+		void *merged = os_malloc(3 * SIZE + 2 * METADATA_SIZE);
+
+		FAIL(merged != ptrs[0], "merged block was not reused");
+
+		os_free(merged);
+		os_free(guard);
+
+		/* Everything merged back with the free tail */
+		FAIL(heap_block_count() != 1, "heap did not merge back into one block");
+	}
+
+	/* A block that ends the heap once it takes the free tail grows in place, nothing else fits it */
+	void *first = os_malloc(BIG_SIZE);
+	void *last = os_malloc(BIG_SIZE);
+
+	os_free(first);
+	FAIL(os_realloc(last, 2 * BIG_SIZE) != last, "block was not grown past the free tail");
+	os_free(last);
+
+	return 0;
+}
@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "unit-utils.h"
+
+/* Cached, heap and mapped sizes */
+static const size_t sizes[] = { 24, 1000, 200 * 1024 };
+
+/* Frees a block with more than its usable size in a child, which must abort */
+static void check_mismatch(size_t size, size_t past_usable)
+{
+	pid_t pid = fork();
+
+	FAIL(pid < 0, "fork failed");
+
+	if (!pid) {
+		void *ptr = os_malloc(size);
+		size_t usable = os_malloc_usable_size(ptr);
+
+		/* The report is expected, keep the output of the test clean */
+		close(STDERR_FILENO);
+		os_free_sized(ptr, past_usable > SIZE_MAX - usable ? SIZE_MAX : usable + past_usable);
+		exit(EXIT_SUCCESS);
+	}
+
+	int status;
+
+	FAIL(waitpid(pid, &status, 0) != pid, "waitpid failed");
+	FAIL(!WIFSIGNALED(status) || WTERMSIG(status) != SIGABRT, "size mismatch did not abort");
+}
+
+int main(void)
+{
+	FAIL(!os_mallopt(OSMEM_OPT_CHECK_FREE_SIZE, 1), "cannot turn the free size check on");
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		size_t size = sizes[i];
+		void *ptr = os_malloc(size);
+
+		/* The size it was asked with and any size up to the usable one are right */
+		os_free_sized(ptr, size);
+		ptr = os_malloc(size);
+		os_free_sized(ptr, os_malloc_usable_size(ptr));
+
+		check_mismatch(size, 1);
+		check_mismatch(size, 4096);
+
+		/* A size that wraps once aligned is still caught */
+		check_mismatch(size, SIZE_MAX);
+	}
+
+	/* Blocks freed with their size are reused */
+	void *ptr = os_malloc(sizes[0]);
+
+	os_free_sized(ptr, sizes[0]);
+	FAIL(os_malloc(sizes[0]) != ptr, "block freed with its size was not reused");
+
+	return 0;
+}
@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "unit-utils.h"
+#include "free_tree.h"
+
+#define NODES 1000
+#define OPS 20000
+
+/* Few sizes, so many nodes share one and are ordered by address */
+#define SIZES 16
+
+/* The tree only links the headers, they never need a payload */
+static struct block_meta nodes[NODES];
+static int in_tree[NODES];
+
+static unsigned int seed = 7;
+
+static size_t node_size(int i)
+{
+	return TREE_MIN_SIZE + (size_t)(rand_r(&seed) % SIZES) * 64 + (i % 2) * 8;
+}
+
+/* Checks the AA tree rules and the order of the nodes, and returns how many there are */
+static size_t check_node(struct block_meta *node, struct block_meta **last)
+{
+	if (!node)
+		return 0;
+
+	struct block_meta *left = node->prev, *right = node->next;
+
+	/* Only leaves are at level one, a left child is one level lower, a right child at most */
+	FAIL(node->owner < 1, "node has no level");
+	FAIL(!left && !right && node->owner != 1, "leaf is not at level one");
+	FAIL(left && left->owner != node->owner - 1, "left child is not one level lower");
+	FAIL(!left && node->owner > 1, "node above level one has no left child");
+	FAIL(right && right->owner != node->owner && right->owner != node->owner - 1,
+		 "right child is not at the same level or one lower");
+	FAIL(!right && node->owner > 1, "node above level one has no right child");
+	FAIL(right && right->next && right->next->owner >= node->owner, "two right horizontal links in a row");
+
+	size_t count = check_node(left, last);
+
+	/* In order, the nodes go by size, then by address */
+	FAIL(*last && ((*last)->size > node->size || ((*last)->size == node->size && *last > node)),
+		 "nodes are out of order");
+	*last = node;
+
+	return count + 1 + check_node(right, last);
+}
+
+static void check_tree(struct block_meta *root, size_t expected)
+{
+	struct block_meta *last = NULL;
+
+	FAIL(check_node(root, &last) != expected, "tree lost or duplicated a node");
+}
+
+/* What the best fit must be, found by looking at every node */
+static struct block_meta *expected_fit(size_t size)
+{
+	struct block_meta *best = NULL;
+
+	for (int i = 0; i < NODES; i++) {
+		if (!in_tree[i] || nodes[i].size < size)
+			continue;
+
+		if (!best || nodes[i].size < best->size || (nodes[i].size == best->size && &nodes[i] < best))
+			best = &nodes[i];
+	}
+
+	return best;
+}
+
+int main(void)
+{
+	struct block_meta *root = NULL;
+	size_t count = 0;
+
+	/* Ascending inserts would make a plain binary tree a list */
+	for (int i = 0; i < NODES / 2; i++) {
+		nodes[i].size = TREE_MIN_SIZE + i * 8;
+		root = tree_insert(root, &nodes[i]);
+		in_tree[i] = 1;
+		check_tree(root, ++count);
+	}
+
+	/* At most two links per level, every path is short */
+	FAIL(root->owner > 10, "tree is not balanced");
+
+	for (int i = 0; i < NODES / 2; i++) {
+		root = tree_remove(root, &nodes[i]);
+		in_tree[i] = 0;
+		check_tree(root, --count);
+	}
+
+	FAIL(root, "tree is not empty after removing every node");
+
+	/* Random inserts and removals, the tree stays valid and finds the best fit */
+	for (int op = 0; op < OPS; op++) {
+		int i = rand_r(&seed) % NODES;
+
+		if (in_tree[i]) {
+			root = tree_remove(root, &nodes[i]);
+			in_tree[i] = 0;
+			count--;
+		} else {
+			nodes[i].size = node_size(i);
+			root = tree_insert(root, &nodes[i]);
+			in_tree[i] = 1;
+			count++;
+		}
+
+		check_tree(root, count);
+
+		size_t size = node_size(op);
+
+		FAIL(tree_best_fit(root, size) != expected_fit(size), "best fit is not the lowest of the smallest fitting");
+	}
+
+	/* Of the blocks with the same size, the one at the lowest address comes first */
+	for (int i = 0; i < NODES; i++) {
+		if (in_tree[i])
+			root = tree_remove(root, &nodes[i]);
+		in_tree[i] = 0;
+	}
+
+	for (int i = NODES - 1; i >= 0; i -= 3) {
+		nodes[i].size = TREE_MIN_SIZE;
+		root = tree_insert(root, &nodes[i]);
+		in_tree[i] = 1;
+	}
+
+	FAIL(tree_best_fit(root, 1) != expected_fit(1), "equal sizes are not taken in address order");
+	FAIL(tree_best_fit(root, TREE_MIN_SIZE + 1), "best fit found a block that is too small");
+
+	return 0;
+}
@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "unit-utils.h"
+#include "map_cache.h"
+
+#define MB (1024 * 1024)
+
+/* Room for three cached 1 MiB blocks with their headers, not for a fourth */
+#define BUDGET (3 * MB + 64 * 1024)
+
+/* Whether the pages of a block are still mapped, msync() fails on a hole */
+static int is_mapped(void *ptr)
+{
+	uintptr_t page = (uintptr_t)ptr & ~((uintptr_t)getpagesize() - 1);
+
+	return !msync((void *)page, getpagesize(), MS_ASYNC);
+}
+
+static void set_budget(int budget)
+{
+	/* Turning the cache off empties it */
+	FAIL(!os_mallopt(OSMEM_OPT_MAP_CACHE, 0), "cannot turn the map cache off");
+	FAIL(!os_mallopt(OSMEM_OPT_MAP_CACHE, budget), "cannot turn the map cache on");
+}
+
+static void check_budget(void)
+{
+	void *ptrs[4];
+
+	set_budget(BUDGET);
+
+	for (int i = 0; i < 4; i++)
+		ptrs[i] = os_malloc(MB);
+
+	/* The oldest region goes once the fourth does not fit */
+	for (int i = 0; i < 4; i++)
+		os_free(ptrs[i]);
+
+	FAIL(is_mapped(ptrs[0]), "cache went over its budget");
+	for (int i = 1; i < 4; i++)
+		FAIL(!is_mapped(ptrs[i]), "region within the budget was unmapped");
+
+	/* A region bigger than the whole budget is never cached */
+	void *big = os_malloc(2 * BUDGET);
+
+	os_free(big);
+	FAIL(is_mapped(big), "region over the budget was cached");
+
+	/* The cached regions are handed out again, the most recent fit first */
+	for (int i = 3; i >= 1; i--)
+		FAIL(os_malloc(MB) != ptrs[i], "cached region was not reused");
+}
+
+static void check_reuse(void)
+{
+	set_budget(8 * MB);
+
+	void *small = os_malloc(MB);
+	void *large = os_malloc(2 * MB);
+
+	os_free(large);
+	os_free(small);
+
+	/* More than half of either region would go unused */
+	void *other = os_malloc(MB / 2 - 64 * 1024);
+
+	FAIL(other == small || other == large, "region more than twice the size was reused");
+	os_free(other);
+
+	/* The shortest region that fits, not the most recent one */
+	FAIL(os_malloc(MB + MB / 4) != large, "region too small was reused, or the fitting one was not");
+	FAIL(os_malloc(MB / 2 + 64 * 1024) != small, "region at most half unused was not reused");
+}
+
+static void check_age(void)
+{
+	struct timespec wait = { .tv_sec = MAP_CACHE_MAX_AGE_MS / 1000 + 1 };
+
+	set_budget(8 * MB);
+
+	void *old = os_malloc(MB);
+	void *recent = os_malloc(MB);
+
+	os_free(old);
+	nanosleep(&wait, NULL);
+
+	/* Caching a region drops the ones that were not reused in time */
+	os_free(recent);
+	FAIL(is_mapped(old), "region older than the maximum age was kept");
+	FAIL(!is_mapped(recent), "recent region was unmapped");
+}
+
+int main(void)
+{
+	check_budget();
+	check_reuse();
+	check_age();
+
+	return 0;
+}
@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <errno.h>
+#include <stdint.h>
+
+#include "unit-utils.h"
+
+/* Neither powers of two nor multiples of a pointer, or only one of them */
+static const size_t bad_alignments[] = { 0, 3, 4, 12, 24, 1000, sizeof(void *) + 1 };
+
+/* Small ones come from the heap, the last one from a mapping */
+static const size_t sizes[] = { 1, 100, 4000, 200000 };
+
+int main(void)
+{
+	void *ptr;
+
+	for (size_t i = 0; i < sizeof(bad_alignments) / sizeof(bad_alignments[0]); i++) {
+		ptr = (void *)0x1;
+		errno = 0;
+
+		FAIL(os_posix_memalign(&ptr, bad_alignments[i], 100) != EINVAL, "bad alignment was not refused with EINVAL");
+		FAIL(ptr != (void *)0x1, "refused posix_memalign wrote the result");
+		FAIL(errno != 0, "posix_memalign set errno");
+	}
+
+	/* memalign only asks for a power of two and reports through errno */
+	errno = 0;
+	FAIL(os_memalign(0, 100) || errno != EINVAL, "memalign took alignment 0");
+	errno = 0;
+	FAIL(os_memalign(24, 100) || errno != EINVAL, "memalign took a non-power-of-two alignment");
+
+	for (size_t alignment = sizeof(void *); alignment <= 65536; alignment *= 2) {
+		for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			errno = ERANGE;
+
+			FAIL(os_posix_memalign(&ptr, alignment, sizes[i]) != 0, "posix_memalign failed");
+			FAIL((uintptr_t)ptr % alignment, "posix_memalign returned a misaligned block");
+			FAIL(errno != ERANGE, "posix_memalign changed errno");
+
+			/* The whole block is usable */
+			memset(ptr, 0xaa, sizes[i]);
+			os_free(ptr);
+
+			ptr = os_memalign(alignment, sizes[i]);
+			FAIL(!ptr || (uintptr_t)ptr % alignment, "memalign returned a misaligned block");
+			os_free(ptr);
+		}
+	}
+
+	/* A zero size is not an error */
+	ptr = (void *)0x1;
+	FAIL(os_posix_memalign(&ptr, 16, 0) != 0 || ptr, "posix_memalign of zero bytes failed");
+
+	return 0;
+}
@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include "unit-utils.h"
+
+/* With a sampling interval of one byte, a block this big is always sampled */
+#define SIZE 4096
+
+/* More than can be mapped, the realloc fails */
+#define HUGE_SIZE (1UL << 46)
+
+static char path[] = "/tmp/test-profile-XXXXXX";
+
+/* Live sampled bytes, from the header of a dumped profile */
+static size_t live_bytes(void)
+{
+	size_t count, bytes;
+
+	FAIL(os_profile_dump(path), "cannot dump the profile");
+
+	FILE *file = fopen(path, "r");
+
+	FAIL(!file, "cannot open the profile");
+	FAIL(fscanf(file, "heap profile: %zu: %zu [", &count, &bytes) != 2, "profile has no header");
+	fclose(file);
+
+	return bytes;
+}
+
+int main(void)
+{
+	int fd = mkstemp(path);
+
+	FAIL(fd == -1, "cannot create the profile file");
+	close(fd);
+
+	FAIL(!os_mallopt(OSMEM_OPT_PROFILE_SAMPLE, 1), "cannot turn the profiler on");
+
+	size_t live = live_bytes();
+
+	/* A heap block and a mapped one */
+	for (size_t size = SIZE; size <= 64 * SIZE; size *= 64) {
+		char *ptr = os_malloc(size);
+
+		FAIL(live_bytes() != live + size, "block was not sampled");
+
+		/* The block stays allocated, so does its sample */
+		FAIL(os_realloc(ptr, HUGE_SIZE) || errno != ENOMEM, "realloc did not fail");
+		FAIL(os_realloc(ptr, SIZE_MAX) || errno != ENOMEM, "realloc did not fail");
+		FAIL(live_bytes() != live + size, "failed realloc dropped the sample");
+
+		/* Only a free can drop it, which must still find it */
+		os_free(ptr);
+		FAIL(live_bytes() != live, "sample outlived its block");
+	}
+
+	unlink(path);
+
+	return 0;
+}
@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <pthread.h>
+
+#include "unit-utils.h"
+#include "arena.h"
+
+/* Too big for the thread caches, so every free goes to the arena */
+#define SIZE 1000
+#define COUNT 64
+
+extern struct arena main_arena;
+
+static void *ptrs[COUNT];
+
+static void *free_remotely(void *arg)
+{
+	(void)arg;
+
+	/* The arena is busy, the blocks are queued on its remote list instead of waiting for it */
+	for (int i = 0; i < COUNT; i++)
+		os_free(ptrs[i]);
+
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t thread;
+
+	for (int i = 0; i < COUNT; i++)
+		ptrs[i] = os_malloc(SIZE);
+
+	void *kept = os_malloc(SIZE);
+
+	lock_arena(&main_arena);
+	pthread_create(&thread, NULL, free_remotely, NULL);
+	pthread_join(thread, NULL);
+	unlock_arena(&main_arena);
+
+	FAIL(!main_arena.remote_frees, "blocks freed while the arena was busy were not queued");
+
+	/* Only freeing from now on is enough to take the queued blocks back */
+	os_free(kept);
+
+	FAIL(main_arena.remote_frees, "remote frees were not drained on free");
+
+	struct osmem_stats stats;
+
+	os_malloc_stats(&stats);
+	FAIL(stats.used_bytes != 0, "queued blocks are still counted as used");
+
+	/* Freed blocks merged back into a single free one */
+	FAIL(stats.block_count != 1, "queued blocks were not merged with their neighbours");
+
+	return 0;
+}
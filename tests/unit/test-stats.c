@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdint.h>
+
+#include "unit-utils.h"
+#include "arena.h"
+#include "block_meta_list.h"
+#include "slab.h"
+#include "compact_heap.h"
+
+#define SLOTS 512
+#define OPS 20000
+
+/* Mostly heap blocks, a few of them past the mmap threshold */
+#define MAX_SMALL 4096
+#define MAX_LARGE (512 * 1024)
+
+extern struct block_meta *mapped_list;
+
+extern size_t blk_meta_size;
+
+static void *slots[SLOTS];
+
+static unsigned int seed = 42;
+
+static size_t stats_class(size_t size)
+{
+	if (size < 16)
+		return 0;
+
+	size_t class = 63 - __builtin_clzl(size) - 3;
+
+	return class < OSMEM_STATS_CLASSES ? class : OSMEM_STATS_CLASSES - 1;
+}
+
+/* Counts every block by walking the heaps, the slabs and the mapped list, and compares with the counters */
+static void check_stats(size_t op)
+{
+	struct osmem_stats stats, walked;
+
+	memset(&walked, 0, sizeof(walked));
+
+	for (int i = 0; i < get_arena_count(); i++) {
+		struct arena *arena = get_arena(i);
+
+		for (struct block_meta *block = first_brk_blk(arena); block; block = get_next_brk_blk(arena, block)) {
+			walked.block_count++;
+			walked.heap_size += block->size + blk_meta_size;
+
+			if (block->status != STATUS_FREE) {
+				walked.used_bytes += block->size;
+				continue;
+			}
+
+			walked.free_bytes += block->size;
+			if (block->size > walked.largest_free_block)
+				walked.largest_free_block = block->size;
+			walked.class_free_blocks[stats_class(block->size)]++;
+			walked.class_free_bytes[stats_class(block->size)] += block->size;
+		}
+	}
+
+	/* The slots of every carved slab, empty slabs keep the slots of their last class */
+	for (struct slab *slab = first_slab(); slab; slab = get_next_slab(slab)) {
+		walked.block_count += slab->total_slots;
+		walked.heap_size += SLAB_SIZE;
+		walked.used_bytes += (size_t)(slab->total_slots - slab->free_slots) * slab->slot_size;
+		walked.free_bytes += (size_t)slab->free_slots * slab->slot_size;
+	}
+
+	for (struct compact_chunk *chunk = first_compact_chunk(); chunk; chunk = get_next_compact_chunk(chunk)) {
+		size_t size = chunk->header & ~(size_t)CHUNK_FLAGS;
+
+		walked.block_count++;
+		walked.heap_size += COMPACT_HEADER_SIZE + size;
+
+		if (chunk->header & CHUNK_IN_USE)
+			walked.used_bytes += size;
+		else
+			walked.free_bytes += size;
+	}
+
+	for (struct block_meta *block = mapped_list; block; block = block->next) {
+		walked.block_count++;
+		walked.mapped_count++;
+		walked.mapped_bytes += block->size;
+		walked.used_bytes += block->size;
+		walked.heap_size += block->size + blk_meta_size;
+	}
+
+	os_malloc_stats(&stats);
+
+	if (stats.block_count != walked.block_count || stats.heap_size != walked.heap_size ||
+		stats.used_bytes != walked.used_bytes || stats.free_bytes != walked.free_bytes ||
+		stats.largest_free_block != walked.largest_free_block || stats.mapped_count != walked.mapped_count ||
+		stats.mapped_bytes != walked.mapped_bytes ||
+		memcmp(stats.class_free_blocks, walked.class_free_blocks, sizeof(stats.class_free_blocks)) ||
+		memcmp(stats.class_free_bytes, walked.class_free_bytes, sizeof(stats.class_free_bytes))) {
+		fprintf(stderr, "op %zu: counted blocks %zu/%zu heap %zu/%zu used %zu/%zu free %zu/%zu largest %zu/%zu\n",
+				op, stats.block_count, walked.block_count, stats.heap_size, walked.heap_size,
+				stats.used_bytes, walked.used_bytes, stats.free_bytes, walked.free_bytes,
+				stats.largest_free_block, walked.largest_free_block);
+		FAIL(1, "statistics do not match the heap walk");
+	}
+}
+
+static size_t random_size(void)
+{
+	return rand_r(&seed) % 32 ? 1 + rand_r(&seed) % MAX_SMALL : 1 + rand_r(&seed) % MAX_LARGE;
+}
+
+static void stress(void)
+{
+	for (size_t op = 0; op < OPS; op++) {
+		size_t slot = rand_r(&seed) % SLOTS;
+		size_t size = random_size();
+
+		switch (rand_r(&seed) % 6) {
+		case 0:
+			os_free(slots[slot]);
+			slots[slot] = os_malloc(size);
+			break;
+		case 1:
+			os_free(slots[slot]);
+			slots[slot] = os_calloc(1, size);
+			break;
+		case 2:
+			/* Grows, shrinks or moves the block */
+			if (slots[slot])
+				slots[slot] = os_realloc(slots[slot], size);
+			break;
+		case 3:
+			os_free(slots[slot]);
+			slots[slot] = os_memalign((size_t)16 << (rand_r(&seed) % 8), size);
+			break;
+		default:
+			os_free(slots[slot]);
+			slots[slot] = NULL;
+			break;
+		}
+
+		check_stats(op);
+	}
+
+	for (size_t slot = 0; slot < SLOTS; slot++) {
+		os_free(slots[slot]);
+		slots[slot] = NULL;
+	}
+
+	check_stats(OPS);
+}
+
+int main(void)
+{
+	stress();
+
+	/* Heaps that shrink and get purged, mappings that are resized, cached and made adaptive */
+	FAIL(!os_mallopt(OSMEM_OPT_TRIM_THRESHOLD, 4096), "cannot set the trim threshold");
+	FAIL(!os_mallopt(OSMEM_OPT_PURGE_THRESHOLD, 8192), "cannot set the purge threshold");
+	FAIL(!os_mallopt(OSMEM_OPT_MREMAP, 1), "cannot turn mremap on");
+	FAIL(!os_mallopt(OSMEM_OPT_MAP_CACHE, 4 * MAX_LARGE), "cannot turn the map cache on");
+	FAIL(!os_mallopt(OSMEM_OPT_MMAP_THRESHOLD_MAX, MAX_LARGE), "cannot make the mmap threshold adaptive");
+	stress();
+
+	/* Small blocks go to the slabs, then to the compact heap */
+	FAIL(!os_mallopt(OSMEM_OPT_SLABS, 1), "cannot turn the slabs on");
+	stress();
+
+	FAIL(!os_mallopt(OSMEM_OPT_SLABS, 0), "cannot turn the slabs off");
+	FAIL(!os_mallopt(OSMEM_OPT_COMPACT_HEADERS, 1), "cannot turn the compact headers on");
+	stress();
+
+	FAIL(!os_mallopt(OSMEM_OPT_COMPACT_HEADERS, 0), "cannot turn the compact headers off");
+
+	/* The per-CPU arenas have their own heaps, and the cached blocks count as used */
+	FAIL(!os_mallopt(OSMEM_OPT_PERCPU_ARENAS, 1), "cannot turn the per-CPU arenas on");
+	stress();
+
+	/* Turning them off drains the cache of every CPU, nothing is left allocated in their heaps */
+	FAIL(!os_mallopt(OSMEM_OPT_PERCPU_ARENAS, 0), "cannot turn the per-CPU arenas off");
+	check_stats(OPS);
+
+	for (int i = 1; i < get_arena_count(); i++) {
+		struct arena *arena = get_arena(i);
+
+		for (struct block_meta *block = first_brk_blk(arena); block; block = get_next_brk_blk(arena, block))
+			FAIL(block->status != STATUS_FREE, "a block cached by a CPU was not drained");
+	}
+
+	return 0;
+}
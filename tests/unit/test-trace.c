@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "unit-utils.h"
+#include "trace.h"
+
+/* The child expands %p to its pid, the parent does the same to find the file */
+#define TRACE_PREFIX "/tmp/osmem-test-trace."
+
+/* More than a buffer, so some records are written while the program runs and the rest at exit */
+#define ROUNDS (TRACE_BUFFER_RECORDS / 2 + 100)
+
+/* The calls of a round, in the order they are made */
+static const uint32_t round_ops[] = {
+	TRACE_MALLOC, TRACE_CALLOC, TRACE_REALLOC, TRACE_MEMALIGN, TRACE_FREE, TRACE_FREE, TRACE_FREE,
+};
+
+#define ROUND_RECORDS (sizeof(round_ops) / sizeof(round_ops[0]))
+
+static void traced_child(void)
+{
+	if (trace_start(TRACE_PREFIX "%p"))
+		exit(EXIT_FAILURE);
+
+	for (size_t i = 0; i < ROUNDS; i++) {
+		void *small = os_malloc(100 + i);
+		void *array = os_calloc(10, 20);
+
+		array = os_realloc(array, 500);
+
+		void *aligned = os_memalign(64, 100);
+
+		os_free(small);
+		os_free(array);
+		os_free(aligned);
+	}
+
+	/* The rest of the records are written when the library is unloaded */
+	exit(EXIT_SUCCESS);
+}
+
+int main(void)
+{
+	char path[64];
+	int status;
+	pid_t pid = fork();
+
+	FAIL(pid == -1, "fork failed");
+	if (!pid)
+		traced_child();
+
+	FAIL(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status),
+		 "traced child failed");
+
+	snprintf(path, sizeof(path), TRACE_PREFIX "%d", pid);
+
+	int fd = open(path, O_RDONLY);
+	struct trace_header header;
+
+	FAIL(fd == -1, "trace file was not created");
+	FAIL(read(fd, &header, sizeof(header)) != sizeof(header), "trace header is missing");
+	FAIL(memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) || header.version != TRACE_VERSION ||
+		 header.record_size != sizeof(struct trace_record), "trace header is wrong");
+
+	size_t count = ROUNDS * ROUND_RECORDS;
+	size_t len = count * sizeof(struct trace_record);
+	struct trace_record *records = malloc(len + 1);
+
+	FAIL(!records, "malloc failed");
+
+	/* Exactly one record for every call, none lost at exit and none made up */
+	FAIL(read(fd, records, len + 1) != (ssize_t)len, "trace does not hold one record per call");
+	close(fd);
+	unlink(path);
+
+	/* A single thread wrote them, so they are in the order of the calls */
+	for (size_t i = 0; i < count; i++) {
+		struct trace_record *record = &records[i];
+
+		FAIL(record->op != round_ops[i % ROUND_RECORDS], "record has the wrong operation");
+		FAIL(record->thread != records[0].thread, "record has the wrong thread");
+		FAIL(i && record->time < records[i - 1].time, "records are not in time order");
+	}
+
+	for (size_t i = 0; i < count; i += ROUND_RECORDS) {
+		struct trace_record *round = &records[i];
+
+		FAIL(round[0].size != 100 + i / ROUND_RECORDS || !round[0].ptr, "malloc record is wrong");
+		FAIL(round[1].size != 200 || !round[1].ptr, "calloc record is wrong");
+		FAIL(round[2].size != 500 || round[2].arg != round[1].ptr, "realloc record is wrong");
+		FAIL(round[3].size != 100 || round[3].arg != 64 || round[3].ptr % 64, "memalign record is wrong");
+
+		/* Frees name the blocks the calls before returned */
+		FAIL(round[4].ptr != round[0].ptr || round[5].ptr != round[2].ptr || round[6].ptr != round[3].ptr,
+			 "free record does not match its block");
+	}
+
+	free(records);
+
+	return 0;
+}
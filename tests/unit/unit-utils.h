@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "osmem.h"
+#include "block_meta.h"
+
+/* Unlike the snippets, these tests check what the allocator does, not which syscalls it makes */
+#define FAIL(assertion, feedback)										\
+	do {													\
+		if (assertion) {										\
+			fprintf(stderr, "(%s, %d): %s\n", __FILE__, __LINE__, feedback);			\
+			exit(EXIT_FAILURE);									\
+		}												\
+	} while (0)
+
+#define METADATA_SIZE		(sizeof(struct block_meta))
+
+static inline size_t heap_block_count(void)
+{
+	struct osmem_stats stats;
+
+	os_malloc_stats(&stats);
+
+	return stats.block_count;
+}
@@ -6,6 +6,16 @@
 #include <stdio.h>
 #include "printf.h"
 
+#ifdef OSMEM_PRELOAD
+/* Standard I/O may allocate, a preloaded allocator must not call back into itself */
+void osmem_die(const char *file, int line, const char *call_description);
+
+#define DIE(assertion, call_description)									\
+	do {													\
+		if (assertion)											\
+			osmem_die(__FILE__, __LINE__, call_description);					\
+	} while (0)
+#else
 #define DIE(assertion, call_description)									\
 	do {													\
 		if (assertion) {										\
@@ -14,11 +24,15 @@
 			exit(errno);										\
 		}												\
 	} while (0)
+#endif
 
 /* Structure to hold memory block metadata */
 struct block_meta {
 	size_t size;
 	int status;
+	/* Index of the arena a heap block belongs to, tree level while free */
+	unsigned short owner;
+	unsigned short flags;
 	struct block_meta *prev;
 	struct block_meta *next;
 };
@@ -27,3 +41,15 @@ struct block_meta {
 #define STATUS_FREE   0
 #define STATUS_ALLOC  1
 #define STATUS_MAPPED 2
+
+/* The whole pages inside a free block were given back and read as zero */
+#define BLOCK_PURGED 1
+
+/* A mapped block that is backed by huge pages, or was asked to be */
+#define BLOCK_HUGE 2
+
+/* A huge block mapped from the hugetlb pool, its mapping only changes by whole huge pages */
+#define BLOCK_HUGETLB 4
+
+/* A mapped block that may start inside the first page of its mapping, which spans whole pages around it */
+#define BLOCK_PAGE_ROUNDED 8
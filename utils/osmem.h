@@ -7,7 +7,69 @@
 #include <stdio.h>
 #include "printf.h"
 
+// Parameters for os_mallopt()
+#define OSMEM_OPT_PERCPU_ARENAS 1
+#define OSMEM_OPT_SLABS 2
+#define OSMEM_OPT_COMPACT_HEADERS 3
+#define OSMEM_OPT_MREMAP 4
+#define OSMEM_OPT_TRIM_THRESHOLD 5
+#define OSMEM_OPT_PURGE_THRESHOLD 6
+#define OSMEM_OPT_MAP_CACHE 7
+#define OSMEM_OPT_MMAP_THRESHOLD_MAX 8
+#define OSMEM_OPT_HUGE_PAGES 9
+#define OSMEM_OPT_CHECK_FREE_SIZE 10
+#define OSMEM_OPT_PROFILE_SAMPLE 11
+
+// Values of OSMEM_OPT_HUGE_PAGES
+#define OSMEM_HUGE_PAGES_THP 1
+#define OSMEM_HUGE_PAGES_HUGETLB 2
+
+// Size classes of struct osmem_stats, class i holds the sizes from 2^(i + 3) up to 2^(i + 4), the last one the bigger ones
+#define OSMEM_STATS_CLASSES 20
+
+/*
+ * Snapshot filled by os_malloc_stats(), the heap covers the brk heap and the per-CPU ones.
+ * Slab slots and compact heap chunks count as blocks too, but only the heap blocks are
+ * sorted into size classes.
+ */
+struct osmem_stats {
+	// Bytes of the heaps, the carved slabs, the compact heap and the mapped blocks, headers included
+	size_t heap_size;
+
+	// Payload of the blocks in use, the ones kept in caches included
+	size_t used_bytes;
+
+	// Payload of the free blocks, and the biggest of the heap ones
+	size_t free_bytes;
+	size_t largest_free_block;
+
+	// Heap and mapped blocks, slab slots and compact heap chunks
+	size_t block_count;
+
+	size_t mapped_count;
+	size_t mapped_bytes;
+
+	size_t huge_page_bytes;
+
+	// Free heap blocks by size class
+	size_t class_free_blocks[OSMEM_STATS_CLASSES];
+	size_t class_free_bytes[OSMEM_STATS_CLASSES];
+};
+
 void *os_malloc(size_t size);
 void os_free(void *ptr);
+void os_free_sized(void *ptr, size_t size);
+size_t os_malloc_batch(size_t size, size_t count, void **ptrs);
+void os_free_batch(void **ptrs, size_t count);
 void *os_calloc(size_t nmemb, size_t size);
 void *os_realloc(void *ptr, size_t size);
+void *os_memalign(size_t alignment, size_t size);
+void *os_aligned_alloc(size_t alignment, size_t size);
+int os_posix_memalign(void **memptr, size_t alignment, size_t size);
+size_t os_malloc_usable_size(void *ptr);
+size_t os_nallocx(size_t size);
+int os_mallopt(int param, int value);
+int os_trim(size_t pad);
+size_t os_huge_page_bytes(void);
+void os_malloc_stats(struct osmem_stats *stats);
+int os_profile_dump(const char *path);